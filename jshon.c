@@ -1,30 +1,60 @@
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <inttypes.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <jansson.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <libgen.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SIMD
+#endif
 
 // MIT licensed, (c) 2011 Kyle Keen <keenerd@gmail.com>
 
 /*
     build with gcc -o jshon jshon.c -ljansson
 
-    stdin is always json
-    stdout is always json (except for -u, -t, -l, -k)
+    stdin is json (or cbor/msgpack, see -A)
+    stdout is json (or cbor/msgpack, see -O) (except for -u, -t, -l, -k, -c, -v)
 
     -P -> detect and ignore JSONP wrapper, if present
+    -E prologue -> ignore this text in front of the json, like )]}'
     -S -> sort keys when writing objects
     -Q -> quiet, suppress stderr
-    -V -> enable slower/safer pass-by-value
+    -V -> enable safer pass-by-value (copy on write)
     -C -> continue through errors
     -F path -> read from file instead of stdin
     -I -> change file in place, requires -F
+    -M -> memory-lean allocation for large inputs
+    -m size -> memory budget, spills to a temp file past it
+    -T threads -> worker threads, defaults to the number of cpus
+    -L -> line-delimited input, run the actions on every line
+    -f -> follow a growing -F file like tail -F, implies -L
+    -K stride -> index every stride-th line of the -F file into path.idx
+    -N lines -> run on these lines of the -F file only, e.g. 5,10-20,300-
+    -R abort|skip|null -> what -L does with a record that fails
+    -z text -> placeholder for missing fields in -c/-v
+    -O json|cbor|msgpack -> output format of the final document
+    -A auto|json|cbor|msgpack -> input format, auto detects
     -0 -> null delimiters
 
     -t(ype) -> str, object, list, number, bool, null
@@ -41,13 +71,24 @@
                        objects will overwrite, arrays will insert
                        arrays can take negative numbers or 'append'
     -a(cross) -> iterate across the current dict or list
+    -x field=value -> lookup the first array element with that field value
+                      hashed, the index is reused until the next edit
+    -H(ash) -> content hash of the subtree, ignores key order
+    -g op[:path] -> count, sum, min, max, mean or distinct over -a
+    -o a,-b.c -> sort an array by key paths, - for descending
+    -G a.b[=op[:path]] -> group an array into an object by key, or key to aggregate
+    -U a.b -> the first element for every distinct key value, "." for whole values
+    -y -> schema summary of the subtree: types, ranges, samples per path
+    -D(iff) path -> print paths that differ from the json in path
+    -c(olumns) a,b.c -> one tab separated row of the named fields
+    -v a,b.c -> same as -c, comma separated values
 
     --version -> returns an arbitrary number, exits
 
     Multiple commands can be chained.
     Entire json is loaded into memory.
-    -e/-a copies and stores on a stack with -V.
-    Could use up a lot of memory, usually does not.
+    -e/-a share values on the stack with -V,
+    -i/-d copy one node before editing a shared value.
     (For now we don't have to worry about circular refs,
     but adding 'swap' breaks that proof.)
 
@@ -84,10 +125,32 @@ static json_t *compat_json_loads(const char *input, json_error_t *error)
 }
 #endif
 
+#if JANSSON_VERSION_HEX < 0x020100
+static json_t *compat_json_loadb(const char *buffer, size_t buflen, json_error_t *error)
+{
+    char *temp = strndup(buffer, buflen);
+    json_t *json = compat_json_loads(temp, error);
+    free(temp);
+    return json;
+}
+#else
+static json_t *compat_json_loadb(const char *buffer, size_t buflen, json_error_t *error)
+{
+    return json_loadb(buffer, buflen, 0, error);
+}
+#endif
+
 #if JANSSON_VERSION_HEX < 0x020400
 #  define JSON_ESCAPE_SLASH 0
 #endif
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#  define MAP_NORESERVE 0
+#endif
+
 #if (defined (__SVR4) && defined (__sun)) || defined (_WIN32)
 #include <stdarg.h>
 
@@ -131,30 +194,71 @@ int asprintf(char **ret, const char *format, ...)
 }
 #endif
 
+int simd_level()
+// 0 plain, 1 sse2, 2 avx2.  asked at runtime, the binary may run on
+// older cpus than it was built for
+{
+    static int level = -1;
+    if (level >= 0)
+        {return level;}
+    level = 0;
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        {level = 1;}
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        {level = 2;}
+#endif
+    return level;
+}
+
 int dumps_flags = JSON_INDENT(1) | JSON_PRESERVE_ORDER | JSON_ESCAPE_SLASH;
 int dumps_compact = JSON_INDENT(0) | JSON_COMPACT | JSON_PRESERVE_ORDER | JSON_ESCAPE_SLASH;
 int by_value = 0;
 int in_place = 0;
+int lean = 0;
 char delim = '\n';
 char* file_path = "";
+FILE* out;  // stdout, or a per-batch buffer in record mode
+FILE* errout;  // stderr, or held per batch by a worker
 
 // for error reporting
 int quiet = 0;
 int crash = 1;
 char** g_argv;
 
+// record mode unwinds a failed record instead of exiting
+int records = 0;
+int follow = 0;
+char* prologue = NULL;  // -E
+char record_policy = 0;  // -R abort, skip or null
+int in_record = 0;
+jmp_buf record_jmp;
+
 // stack depth is limited by maxargs
 // if you need more depth, use a SAX parser
 #define STACKDEPTH 128
 
+// stdout buffer size when writing to a pipe or file
+#define OUTBUFSIZ (1 << 16)
+
 json_t* stack[STACKDEPTH];
 json_t** stackpointer = stack;
 
+// with -V a slot may hold a reference shared with the tree below it
+// the value is copied only when an edit touches that slot
+char shared[STACKDEPTH];
+// and whether the slot holds a reference of its own to let go of.
+// without -V a value from inside the tree is only borrowed
+char owned[STACKDEPTH];
+
 void err(char* message)
 // also see arg_err() and json_err() below
 {
     if (!quiet)
-        {fprintf(stderr, "%s\n", message);}
+        {fprintf(errout, "%s\n", message);}
+    if (crash && in_record)
+        {longjmp(record_jmp, 1);}
     if (crash)
         {exit(1);}
 }
@@ -162,16 +266,22 @@ void err(char* message)
 void hard_err(char* message)
 {
     err(message);
+    if (in_record)
+        {longjmp(record_jmp, 1);}
     exit(1);
 }
 
 void arg_err(char* message)
 {
-    char* temp;
+    static char* temp = NULL;  // a record may never come back to free it
     int i;
+    free(temp);
     i = asprintf(&temp, message, optind-1, g_argv[optind-1]);
     if (i == -1)
-        {hard_err("internal error: out of memory");}
+    {
+        temp = NULL;
+        hard_err("internal error: out of memory");
+    }
     err(temp);
 }
 
@@ -184,6 +294,8 @@ void PUSH(json_t* json)
         arg_err("parse error: bad json on arg %i, \"%s\"");
         json = json_null();
     }
+    shared[stackpointer - stack] = 0;
+    owned[stackpointer - stack] = 1;
     *stackpointer++ = json;
 }
 
@@ -201,20 +313,55 @@ json_t** stack_safe_peek()
 #define POP        *((stackpointer = stack_safe_peek()))
 #define PEEK       *(stack_safe_peek())
 
-json_t* maybe_deep(json_t* json)
+void PUSH_SHARED(json_t* json)
+// for values still owned by the tree, like extract()
 {
-    if (by_value)
-        {return json_deep_copy(json);}
-    return json;
+    if (!by_value)
+    {
+        PUSH(json);
+        owned[stackpointer - stack - 1] = 0;
+        return;
+    }
+    PUSH(json_incref(json));
+    shared[stackpointer - stack - 1] = 1;
+}
+
+#define POPPED     owned[stackpointer - stack]  // right after a POP
+
+void memo_reset();
+
+void release(json_t* json)
+// a freed container's address may come back, and the hash memos are
+// keyed by address
+{
+    if (json->refcount == 1 && (json_is_object(json) || json_is_array(json)))
+        {memo_reset();}
+    json_decref(json);
+}
+
+void stack_release(json_t** to)
+// drops every slot above to, or brings back the slots an -a body
+// popped below its own value
+{
+    if (stackpointer < to)
+        {stackpointer = to;}
+    while (stackpointer > to)
+    {
+        stackpointer--;
+        if (owned[stackpointer - stack])
+            {release(*stackpointer);}
+    }
 }
 
 typedef struct
 {
     void*    itr;  // object iterator
+    json_t*  json; // the node iterated, held while mapping
     json_t** stk;  // stack reentry
     uint     lin;  // array iterator
     int      opt;  // optind reentry
     int      fin;  // finished iteration
+    int      agg;  // -g is collecting values
 } mapping;
 
 mapping mapstack[STACKDEPTH];
@@ -231,9 +378,13 @@ void MAPPUSH()
 {
     if (mapstackpointer >= &mapstack[STACKDEPTH])
         {hard_err("internal error: mapstack overflow");}
+    // -V copies the value only once something edits it, the
+    // iterator keeps going over the node it started on
     mapstackpointer++;
+    map_safe_peek()->json = json_incref(PEEK);
     map_safe_peek()->stk = stack_safe_peek();
     map_safe_peek()->opt = optind;
+    map_safe_peek()->agg = 0;
     switch (json_typeof(PEEK))
     {
         case JSON_OBJECT:
@@ -242,7 +393,7 @@ void MAPPUSH()
             break;
         case JSON_ARRAY:
             map_safe_peek()->lin = 0;
-            map_safe_peek()->fin = json_array_size(*(map_safe_peek()->stk)) == 0;
+            map_safe_peek()->fin = json_array_size(PEEK) == 0;
             break;
         default:
             err("parse error: type not mappable");
@@ -251,21 +402,21 @@ void MAPPUSH()
 
 void MAPNEXT()
 {
-    stackpointer = map_safe_peek()->stk + 1;
+    stack_release(map_safe_peek()->stk + 1);
     optind = map_safe_peek()->opt;
-    switch (json_typeof(*(map_safe_peek()->stk)))
+    switch (json_typeof(map_safe_peek()->json))
     {
         case JSON_OBJECT:
             json_object_iter_key(map_safe_peek()->itr);
-            PUSH(maybe_deep(json_object_iter_value(map_safe_peek()->itr)));
-            map_safe_peek()->itr = json_object_iter_next(*(map_safe_peek()->stk), map_safe_peek()->itr);
+            PUSH_SHARED(json_object_iter_value(map_safe_peek()->itr));
+            map_safe_peek()->itr = json_object_iter_next(map_safe_peek()->json, map_safe_peek()->itr);
             if (!map_safe_peek()->itr)
                 {map_safe_peek()->fin = 1;}
             break;
         case JSON_ARRAY:
-            PUSH(maybe_deep(json_array_get(*(map_safe_peek()->stk), map_safe_peek()->lin)));
+            PUSH_SHARED(json_array_get(map_safe_peek()->json, map_safe_peek()->lin));
             map_safe_peek()->lin++;
-            if (map_safe_peek()->lin >= json_array_size(*(map_safe_peek()->stk)))
+            if (map_safe_peek()->lin >= json_array_size(map_safe_peek()->json))
                 {map_safe_peek()->fin = 1;}
             break;
         default:
@@ -276,50 +427,434 @@ void MAPNEXT()
 
 void MAPPOP()
 {
-    stackpointer = map_safe_peek()->stk;
+    stack_release(map_safe_peek()->stk);
     optind = map_safe_peek()->opt;
+    release(map_safe_peek()->json);
     mapstackpointer = map_safe_peek();
 }
 
+void writable_top()
+// copy-on-write, copying one node is enough because every edit
+// only changes the top level of the node it pops.  an -a over the
+// node carries on over the copy, so it sees the edit
+{
+    json_t** top = stack_safe_peek();
+    json_t* copy;
+    mapping* m;
+    if (!shared[top - stack])
+        {return;}
+    copy = json_copy(*top);
+    if (copy == NULL)
+        {hard_err("internal error: out of memory");}
+    for (m = mapstack; m < mapstackpointer; m++)
+    {
+        if (m->stk != top || m->json != *top)
+            {continue;}
+        if (json_is_object(copy) && m->itr)
+            {m->itr = json_object_iter_at(copy, json_object_iter_key(m->itr));}
+        release(m->json);
+        m->json = json_incref(copy);
+    }
+    release(*top);
+    *top = copy;
+    shared[top - stack] = 0;
+}
+
+json_t* pop_writable()
+{
+    writable_top();
+    return POP;
+}
+
+void map_release()
+// unwinds every -a, and the stack with it
+{
+    while (mapstackpointer > mapstack)
+        {MAPPOP();}
+    stack_release(stack);
+}
+
 // can not use two macros on the same line
 #define MAPPEEK       *(map_safe_peek())
 #define MAPEMPTY      (mapstackpointer == mapstack)
 
-char* loop_read_fd(int fd)
+void drop_slot(json_t** slot)
+// lets go of a popped slot's value unless the next -a round brings
+// the slot back
+{
+    if (!owned[slot - stack])
+        {return;}
+    if (MAPEMPTY || slot > map_safe_peek()->stk)
+        {release(*slot);}
+}
+
+// memory budget (-m)
+// jansson's allocations and the input buffer are counted against the
+// budget.  past it, blocks come from a file in $TMPDIR mapped into
+// memory, so the kernel can write them out and page them back in
+// instead of holding everything in anonymous memory.  disk space is
+// reserved up front so a full disk is an error here and not a SIGBUS
+// later.  regular input files are mapped rather than read.
+
+#define HEAPHEADER   16         // keeps the size, aligns like malloc
+#define SPILLCHUNK   (1 << 26)  // file space added at a time
+#define SPILLCLASSES 48         // blocks of 32 << class bytes
+
+size_t budget = 0;       // 0 is no limit
+size_t budget_used = 0;
+
+char*  spill_base = NULL;
+size_t spill_reserved = 0;
+size_t spill_committed = 0;
+size_t spill_used = 0;
+size_t spill_floor = 0;      // blocks below were mapped by the parent process
+size_t spill_file_base = 0;  // region offset of the current file's first byte
+int    spill_fd = -1;
+void*  spill_free_list[SPILLCLASSES];
+
+size_t parse_size(char* arg)
+// 512k, 64M, 2G, or plain bytes
+{
+    char* endptr;
+    unsigned long long n;
+    int shift = 0;
+    errno = 0;
+    n = strtoull(arg, &endptr, 10);
+    switch (tolower(*endptr))
+    {
+        case 'g':
+            shift = 30;
+            endptr++;
+            break;
+        case 'm':
+            shift = 20;
+            endptr++;
+            break;
+        case 'k':
+            shift = 10;
+            endptr++;
+            break;
+    }
+    // strtoull saturates and takes a sign, neither is a size
+    if (!isdigit((unsigned char)*arg) || errno || *endptr != '\0' || n == 0 || n > (SIZE_MAX >> shift))
+    {
+        arg_err("parse error: illegal memory budget on arg %i, \"%s\"");
+        return 0;
+    }
+    return (size_t)n << shift;
+}
+
+char* reserve_region(size_t* size, size_t least)
+// address space only, shrinks the request on small address spaces
+{
+    char* base;
+    *size = (size_t)1 << (sizeof(size_t) > 4 ? 40 : 30);
+    for (; *size >= least; *size /= 2)
+    {
+        base = mmap(NULL, *size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED)
+            {return base;}
+    }
+    *size = 0;
+    return NULL;
+}
+
+void spill_fail(const char* reason)
+// not err(): this runs inside jansson and can not unwind
+{
+    if (!quiet)
+    {
+        fprintf(errout, "error: memory budget of %zu bytes exceeded and spilling to disk failed: %s\n",
+                budget, reason);
+    }
+    exit(1);
+}
+
+void spill_open()
+{
+    char* dir = getenv("TMPDIR");
+    char* path;
+    if (!dir || !dir[0])
+        {dir = "/tmp";}
+    if (asprintf(&path, "%s/jshon-spill-XXXXXX", dir) == -1)
+        {spill_fail("out of memory");}
+    spill_fd = mkstemp(path);
+    if (spill_fd < 0)
+        {spill_fail(strerror(errno));}
+    unlink(path);
+    free(path);
+}
+
+void spill_commit(size_t need)
+{
+    int e;
+    if (!spill_base)
+    {
+        spill_base = reserve_region(&spill_reserved, SPILLCHUNK);
+        if (!spill_base)
+            {spill_fail("could not reserve address space");}
+    }
+    while (spill_committed < need)
+    {
+        if (spill_committed + SPILLCHUNK > spill_reserved)
+            {spill_fail("address space exhausted");}
+        if (spill_fd < 0)
+            {spill_open();}
+        e = posix_fallocate(spill_fd, spill_committed - spill_file_base, SPILLCHUNK);
+        if (e)
+            {spill_fail(strerror(e));}
+        if (mmap(spill_base + spill_committed, SPILLCHUNK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 spill_fd, spill_committed - spill_file_base) == MAP_FAILED)
+            {spill_fail(strerror(errno));}
+        spill_committed += SPILLCHUNK;
+    }
+}
+
+void* spill_alloc(size_t size)
+// power of two blocks with a header holding the class
+{
+    size_t c = 0;
+    char* p;
+    while (c < SPILLCLASSES && ((size_t)32 << c) < size + HEAPHEADER)
+        {c++;}
+    if (c == SPILLCLASSES)
+        {spill_fail("block too large");}
+    if ((p = spill_free_list[c]))
+    {
+        spill_free_list[c] = *(void**)p;
+        return p;
+    }
+    spill_commit(spill_used + ((size_t)32 << c));
+    p = spill_base + spill_used;
+    spill_used += (size_t)32 << c;
+    *(size_t*)p = c;
+    return p + HEAPHEADER;
+}
+
+void spill_release(void* p)
+{
+    char* block = (char*)p - HEAPHEADER;
+    size_t c = *(size_t*)block;
+    if (block < spill_base + spill_floor)
+        {return;}
+    *(void**)p = spill_free_list[c];
+    spill_free_list[c] = p;
+}
+
+void spill_detach()
+// after fork() the mapped file is shared with the parent
+// leave those pages alone and continue in a file of our own
+{
+    if (spill_fd < 0)
+        {return;}
+    close(spill_fd);
+    spill_fd = -1;
+    spill_floor = spill_used = spill_file_base = spill_committed;
+    memset(spill_free_list, 0, sizeof(spill_free_list));
+}
+
+void* heap_alloc(size_t size)
+{
+    size_t* p;
+    if (!budget)
+        {return malloc(size);}
+    if (budget_used + size + HEAPHEADER <= budget && (p = malloc(size + HEAPHEADER)))
+    {
+        p[0] = size;
+        budget_used += size + HEAPHEADER;
+        return (char*)p + HEAPHEADER;
+    }
+    return spill_alloc(size);
+}
+
+void heap_release(void* p)
+{
+    char* block = (char*)p - HEAPHEADER;
+    if (!budget || p == NULL)
+    {
+        free(p);
+        return;
+    }
+    if ((char*)p >= spill_base && (char*)p < spill_base + spill_used)
+    {
+        spill_release(p);
+        return;
+    }
+    budget_used -= *(size_t*)block + HEAPHEADER;
+    free(block);
+}
+
+void* heap_grow(void* p, size_t old, size_t size)
+// realloc() for buffers that may have spilled
+{
+    void* grown;
+    if (!budget)
+        {return realloc(p, size);}
+    grown = heap_alloc(size);
+    if (grown && p)
+    {
+        memcpy(grown, p, old);
+        heap_release(p);
+    }
+    return grown;
+}
+
+// memory-lean mode (-M)
+// jansson makes a small allocation for every value, object member and
+// string.  malloc adds a header to each and rounds it up to 16 bytes.
+// here small blocks come from slabs of a single size class, carved out
+// of one reserved address range so free() can tell them apart.
+
+#define SLABSIZE    (1 << 16)
+#define SLABCLASSES 16          // 8 to 128 bytes in steps of 8
+#define LEANCOMMIT  (1 << 20)   // address space made usable at a time
+
+char*  lean_base = NULL;
+size_t lean_reserved = 0;
+size_t lean_committed = 0;
+size_t lean_used = 0;
+void*  lean_free_list[SLABCLASSES + 1];
+char*  lean_next[SLABCLASSES + 1];
+char*  lean_end[SLABCLASSES + 1];
+
+int lean_slab(size_t c)
+// each slab starts with an 8 byte header holding its size class
+{
+    char* slab;
+    if (lean_used + SLABSIZE > lean_reserved)
+        {return 0;}
+    if (lean_used + SLABSIZE > lean_committed)
+    {
+        // slabs count against -m, past it small blocks spill too
+        if (budget && budget_used + LEANCOMMIT > budget)
+            {return 0;}
+        if (mprotect(lean_base + lean_committed, LEANCOMMIT, PROT_READ | PROT_WRITE))
+            {return 0;}
+        lean_committed += LEANCOMMIT;
+        budget_used += LEANCOMMIT;
+    }
+    slab = lean_base + lean_used;
+    lean_used += SLABSIZE;
+    slab[0] = (char)c;
+    lean_next[c] = slab + 8;
+    lean_end[c] = slab + SLABSIZE;
+    return 1;
+}
+
+void* lean_alloc(size_t size)
+{
+    size_t c = (size + 7) / 8;
+    void* p;
+    if (c > SLABCLASSES || !lean_base)
+        {return heap_alloc(size);}
+    if (c == 0)
+        {c = 1;}
+    if ((p = lean_free_list[c]))
+    {
+        lean_free_list[c] = *(void**)p;
+        return p;
+    }
+    if (lean_next[c] + c * 8 > lean_end[c] && !lean_slab(c))
+        {return heap_alloc(size);}
+    p = lean_next[c];
+    lean_next[c] += c * 8;
+    return p;
+}
+
+void lean_release(void* p)
+{
+    char* slab;
+    if (p == NULL)
+        {return;}
+    if ((char*)p < lean_base || (char*)p >= lean_base + lean_used)
+    {
+        heap_release(p);
+        return;
+    }
+    slab = lean_base + (((char*)p - lean_base) & ~(size_t)(SLABSIZE - 1));
+    *(void**)p = lean_free_list[(unsigned char)slab[0]];
+    lean_free_list[(unsigned char)slab[0]] = p;
+}
+
+// jansson may allocate from worker threads, see run_parallel()
+int lean_locking = 0;
+pthread_mutex_t lean_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* lean_malloc(size_t size)
+{
+    void* p;
+    if (!lean_locking)
+        {return lean_alloc(size);}
+    pthread_mutex_lock(&lean_lock);
+    p = lean_alloc(size);
+    pthread_mutex_unlock(&lean_lock);
+    return p;
+}
+
+void lean_free(void* p)
+{
+    if (!lean_locking)
+        {lean_release(p); return;}
+    pthread_mutex_lock(&lean_lock);
+    lean_release(p);
+    pthread_mutex_unlock(&lean_lock);
+}
+
+void lean_init()
+// must run before jansson allocates anything, also used for -m alone
+{
+#if JANSSON_VERSION_HEX < 0x020400
+    err("warning: memory-lean mode (-M) and budgets (-m) require jansson 2.4");
+#else
+    if (lean)
+    {
+        lean_base = reserve_region(&lean_reserved, LEANCOMMIT);
+        if (!lean_base)
+            {err("warning: memory-lean mode (-M) could not reserve memory");}
+    }
+    if (lean_base || budget)
+        {json_set_alloc_funcs(lean_malloc, lean_free);}
+#endif
+}
+
+char* loop_read_fd(int fd, size_t* len)
 {
     char buffer[BUFSIZ];
     char *content = NULL;
     size_t content_size = 0;
     size_t content_capacity = BUFSIZ * 2.5;
 
-    content = malloc(content_capacity);
+    content = heap_alloc(content_capacity);
     if (content == NULL)
     {
-        fprintf(stderr, "error: failed to allocate %zd bytes\n", content_capacity);
+        fprintf(errout, "error: failed to allocate %zd bytes\n", content_capacity);
         return NULL;
     }
+    content[0] = '\0';
 
     for (;;)
     {
         ssize_t bytes_r = read(fd, buffer, sizeof(buffer));
         if (bytes_r < 0)
         {
-            fprintf(stderr, "error: failed to read from fd: %s\n", strerror(errno));
+            fprintf(errout, "error: failed to read from fd: %s\n", strerror(errno));
             goto fail;
         }
 
         if (bytes_r == 0)
         {
+            *len = content_size;
             return content;
         }
 
         if (content_size + bytes_r >= content_capacity)
         {
+            size_t old_capacity = content_capacity;
             content_capacity *= 2.5;
-            void *newalloc = realloc(content, content_capacity);
+            void *newalloc = heap_grow(content, old_capacity, content_capacity);
             if (newalloc == NULL)
             {
-                fprintf(stderr, "error: failed to reallocate buffer to %zd bytes\n",
+                fprintf(errout, "error: failed to reallocate buffer to %zd bytes\n",
                         content_capacity);
                 goto fail;
             }
@@ -334,75 +869,136 @@ char* loop_read_fd(int fd)
     return content;
 
 fail:
-    free(content);
+    heap_release(content);
     return NULL;
 }
 
-char* read_stream(FILE* fp)
+// inputs mapped by map_stream(), so free_input() can tell them apart
+#define MAPPEDINPUTS 4
+char*  mapped_input[MAPPEDINPUTS];
+size_t mapped_size[MAPPEDINPUTS];
+
+char* map_stream(FILE* fp, size_t size)
+// maps a regular file copy-on-write, with a zero page behind it as the
+// nul terminator.  NULL if it can not be mapped, then read it instead
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t total = (size + 1 + page - 1) / page * page;
+    off_t pos = lseek(fileno(fp), 0, SEEK_CUR);
+    char* region;
+    int i = 0;
+    while (i < MAPPEDINPUTS && mapped_input[i])
+        {i++;}
+    if (i == MAPPEDINPUTS || pos != 0)
+        {return NULL;}
+    region = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        {return NULL;}
+    if (mmap(region, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(fp), 0) == MAP_FAILED)
+    {
+        munmap(region, total);
+        return NULL;
+    }
+    mapped_input[i] = region;
+    mapped_size[i] = total;
+    return region;
+}
+
+void free_input(char* content)
+{
+    int i;
+    for (i = 0; i < MAPPEDINPUTS; i++)
+    {
+        if (mapped_input[i] == content)
+        {
+            munmap(content, mapped_size[i]);
+            mapped_input[i] = NULL;
+            return;
+        }
+    }
+    heap_release(content);
+}
+
+char* read_stream(FILE* fp, size_t* len)
+// the buffer is nul terminated, len excludes the terminator
 {
     struct stat st;
     char *buffer;
 
     if (fstat(fileno(fp), &st) < 0)
     {
-        fprintf(stderr, "failed to stat file: %s\n", strerror(errno));
+        fprintf(errout, "failed to stat file: %s\n", strerror(errno));
         return NULL;
     }
 
     if (st.st_size == 0 && lseek(fileno(fp), 0, SEEK_CUR) < 0)
     {
-        return loop_read_fd(fileno(fp));
+        return loop_read_fd(fileno(fp), len);
+    }
+
+    if (budget && (buffer = map_stream(fp, st.st_size)))
+    {
+        *len = st.st_size;
+        return buffer;
     }
 
-    buffer = malloc(st.st_size + 1);
+    buffer = heap_alloc(st.st_size + 1);
     if (buffer == NULL)
     {
-        fprintf(stderr, "error: failed to allocate %zd bytes\n", (ssize_t)(st.st_size + 1));
+        fprintf(errout, "error: failed to allocate %zd bytes\n", (ssize_t)(st.st_size + 1));
         return NULL;
     }
 
     size_t bytes_r = fread(buffer, 1, st.st_size, fp);
     if ((ssize_t)bytes_r != st.st_size)
     {
-        fprintf(stderr, "short read: expected to read %zd bytes, only got %zd\n",
+        fprintf(errout, "short read: expected to read %zd bytes, only got %zd\n",
                 (ssize_t)st.st_size, (ssize_t)bytes_r);
     }
 
     buffer[bytes_r] = 0;
+    *len = bytes_r;
 
     return buffer;
 }
 
-char* read_stdin(void)
+char* read_stdin(size_t* len)
 {
+    *len = 0;
     if (isatty(fileno(stdin)))
         {return "";}
-    return read_stream(stdin);
+    return read_stream(stdin, len);
 }
 
-char* read_file(char* path)
+char* read_file(char* path, size_t* len)
 {
     FILE* fp;
     char* content;
     fp = fopen(path, "r");
     if ( !fp ) {
-      fprintf(stderr, "unable to read file %s: %s\n", path, strerror(errno));
+      fprintf(errout, "unable to read file %s: %s\n", path, strerror(errno));
       return NULL;
     }
-    content = read_stream(fp);
+    content = read_stream(fp, len);
     fclose(fp);
     return content;
 }
 
-char* remove_jsonp_callback(char* in, int* rows_skipped, int* cols_skipped)
-// this 'removes' jsonp callback code which can surround json, by returning
-// a pointer to first byte of real JSON, and overwriting the jsonp stuff at
-// the end of the input with a null byte. it also writes out the number of
+#define WRAPSCAN 4096  // how deep a wrapper is looked for from either end
+
+char* strip_wrapper(char* in, size_t* len, char* prefix, int* jsonp, int* rows_skipped, int* cols_skipped)
+// finds the json inside an optional prologue (-E, like the )]}' guard
+// some apis put in front) and an optional jsonp callback (-P).  returns a
+// pointer to the first byte of real JSON and shortens *len to end at its
+// last byte.  the buffer is left alone so the parser can run on the range
+// as it is.  neither end is searched deeper than WRAPSCAN bytes, so the
+// cost does not grow with the input.  it also writes out the number of
 // lines, and then columns, which were skipped over.
 //
-// if a legitimate jsonp callback surround is not detected, the original
-// input is returned and no other action is taken. this means that JSONP
-// syntax errors will be effectively ignored, and will then fail json parsing
+// if a legitimate jsonp callback surround is not detected, the range is
+// left as it was and *jsonp stays 1, otherwise it becomes 2.  this means
+// that JSONP syntax errors will be effectively ignored, and will then
+// fail json parsing
 //
 // this doesn't detect all conceivable JSONP wrappings. a simple function call
 // with a reasonable ASCII identifier will work, and that covers 99% of the
@@ -412,62 +1008,84 @@ char* remove_jsonp_callback(char* in, int* rows_skipped, int* cols_skipped)
     #define JSON_IDENTIFIER(x) (isalnum(x) || (x) == '$' || (x) == '_' || (x) == '.')
 
     char* first = in;
-    char* last = in + strlen(in) - 1;
-
-    // skip over whitespace and semicolons at the end
-    while (first < last && (JSON_WHITE(*last) || *last == ';'))
-        {--last;}
-
-    // count closing brackets at the end, still skipping whitespace
+    char* end = in + *len;
+    char* last;
+    char* low;
+    char* high;
+    char* p;
+    size_t n;
     int brackets = 0;
-    while (first < last && (JSON_WHITE(*last) || *last == ')'))
+
+    if (prefix && (n = strlen(prefix)))
     {
-        if (*last == ')')
-            {++brackets;}
-        --last;
+        p = first;
+        while (p < end && p - first < WRAPSCAN && JSON_WHITE(*p))
+            {++p;}
+        if ((size_t)(end - p) >= n && !memcmp(p, prefix, n))
+            {first = p + n;}
     }
 
-    // no closing brackets? it's not jsonp
-    if (brackets == 0)
-        {return in;}
+    if (*jsonp && first < end)
+    {
+        last = end - 1;
+        low = end - first > WRAPSCAN ? end - WRAPSCAN : first;
+        high = end - first > WRAPSCAN ? first + WRAPSCAN : last;
 
-    // skip leading whitespace
-    while (first < last && JSON_WHITE(*first))
-        {++first;}
+        // skip over whitespace and semicolons at the end
+        while (low < last && (JSON_WHITE(*last) || *last == ';'))
+            {--last;}
 
-    // skip leading identifier if present
-    while (first < last && JSON_IDENTIFIER(*first))
-        {++first;}
+        // count closing brackets at the end, still skipping whitespace
+        while (low < last && (JSON_WHITE(*last) || *last == ')'))
+        {
+            if (*last == ')')
+                {++brackets;}
+            --last;
+        }
 
-    // skip over forward brackets and whitespace, counting down the opening brackets
-    // against the closing brackets we've already done
-    while (first < last && (JSON_WHITE(*first) || *first == '('))
-    {
-        if (*first == '(')
-            {--brackets;}
-        ++first;
-    }
+        // no closing brackets? it's not jsonp
+        if (brackets)
+        {
+            // skip leading whitespace, an identifier if present, then the
+            // forward brackets, counting them down against the closing ones
+            p = first;
+            while (p < high && p < last && JSON_WHITE(*p))
+                {++p;}
+            while (p < high && p < last && JSON_IDENTIFIER(*p))
+                {++p;}
+            while (p < high && p < last && (JSON_WHITE(*p) || *p == '('))
+            {
+                if (*p == '(')
+                    {--brackets;}
+                ++p;
+            }
 
-    // at this point we have a valid jsonp wrapper, provided that the number of opening
-    // and closing brackets matched, and provided the two pointers didn't meet in
-    // the middle (leaving no room for any actual JSON)
-    if (brackets != 0 || !(first < last))
-        {return in;}
+            // at this point we have a valid jsonp wrapper, provided that the
+            // number of opening and closing brackets matched, and provided the
+            // two pointers didn't meet in the middle (leaving no room for any
+            // actual JSON)
+            if (brackets == 0 && p < last)
+            {
+                first = p;
+                end = last + 1;
+                *jsonp = 2;
+            }
+        }
+    }
 
-    // count lines and columns skipped over
+    // count lines and columns skipped over, at most the two scans above
     *rows_skipped = *cols_skipped = 0;
-    while (in < first) 
+    for (p = in; p < first; p++)
     {
         ++*cols_skipped;
-        if (*in++ == '\n')
+        if (*p == '\n')
         {
             *cols_skipped = 0;
             ++*rows_skipped;
         }
     }
 
-    // strip off beginning and end
-    *(last+1) = '\0';
+    *len = end - first;
     return first;
 }
 
@@ -540,76 +1158,496 @@ char* smart_dumps(json_t* json, int flags)
 }
 #endif
 
-/*char* pretty_dumps(json_t* json)
-// underscore-style colorizing
-// needs a more or less rewrite of dumps()
+#if JANSSON_VERSION_HEX < 0x020100
+void smart_dumpf(json_t* json, int flags, FILE* fp)
 {
-    int depth = 0;
-    // loop over everything
-    // needs a stack
-    // number, orange
-    // string, green
-    // null, bold white
-    // string, purple?
-}*/
-
-#if JANSSON_VERSION_HEX < 0x020300
-json_t* smart_loads(char* j_string)
-// json_loads is broken on simple types
+    char* temp = smart_dumps(json, flags);
+    fputs(temp, fp);
+    if (json_is_object(json) || json_is_array(json) || json_is_string(json) || json_is_number(json))
+        {free(temp);}
+}
+#elif JANSSON_VERSION_HEX < 0x020200
+void smart_dumpf(json_t* json, int flags, FILE* fp)
 {
-    json_t* json;
-    json_error_t error;
-    char *temp;
-    int i;
-    i = asprintf(&temp, "[%s]", j_string);
-    if (i == -1)
-        {hard_err("internal error: out of memory");}
-    json = compat_json_loads(temp, &error);
-    if (!json)
-        {return json_string(j_string);}
-    return json_array_get(json, 0);
+    if (!flags)
+        {flags = dumps_flags;}
+    if (json_dumpf(json, fp, flags | JSON_ENCODE_ANY))
+        {err("error: failed to write output");}
 }
 #else
-json_t* smart_loads(char* j_string)
+typedef struct
 {
-    json_error_t error;
-    return json_loads(j_string, JSON_DECODE_ANY, &error);
+    FILE*  fp;
+    size_t len;
+    char   buf[OUTBUFSIZ];
+} out_sink;
+
+int sink_flush(out_sink* sink)
+{
+    size_t n = sink->len;
+    sink->len = 0;
+    return fwrite(sink->buf, 1, n, sink->fp) != n;
 }
-#endif
 
-char* pretty_type(json_t* json)
+int sink_write(const char* buffer, size_t size, void* data)
+// jansson emits tiny pieces, batch them instead of one fwrite each
 {
-    if (json == NULL)
-        {err("internal error: null pointer"); return "NULL";}
-    switch (json_typeof(json))
+    out_sink* sink = data;
+    if (sink->len + size > sizeof(sink->buf) && sink_flush(sink))
+        {return -1;}
+    if (size > sizeof(sink->buf))
+        {return fwrite(buffer, 1, size, sink->fp) != size;}
+    memcpy(sink->buf + sink->len, buffer, size);
+    sink->len += size;
+    return 0;
+}
+
+#if JANSSON_VERSION_HEX >= 0x020e00
+// jshon's own encoder, the same bytes as jansson 2.14's dump.c.
+// strings are the bulk of most output, so the scan for characters
+// that need escaping looks at 16 or 32 bytes per step where the cpu
+// allows it and copies clean runs in one piece.  multibyte characters
+// stop the scan too and are checked like jansson checks them.  older
+// jansson releases format differently and keep using
+// json_dump_callback, and so does anything nested deeper than
+// DUMPDEPTH.
+
+#define DUMPDEPTH 2048
+
+size_t clean_scalar(const unsigned char* s, size_t n, int slash)
+// length of the leading ascii run that can be copied unescaped
+{
+    size_t i;
+    for (i = 0; i < n; i++)
     {
-        case JSON_OBJECT:
-            return "object";
-        case JSON_ARRAY:
-            return "array";
-        case JSON_STRING:
-            return "string";
-        case JSON_INTEGER:
-        case JSON_REAL:
-            return "number";
-        case JSON_TRUE:
-        case JSON_FALSE:
-            return "bool";
-        case JSON_NULL:
-            return "null";
-        default:
-            err("internal error: unknown type");
-            return "NULL";
+        if (s[i] < 0x20 || s[i] >= 0x80 || s[i] == '"' || s[i] == '\\' || (slash && s[i] == '/'))
+            {break;}
     }
+    return i;
 }
 
-void json_err(char* message, json_t* json)
+size_t utf8_length(const unsigned char* s, size_t n)
+// bytes in the valid utf-8 character at s, 0 if it is not one
 {
-    char* temp;
-    int i;
-    i = asprintf(&temp, "parse error: type '%s' %s (arg %i)", pretty_type(json), message, optind-1);
+    size_t len, i;
+    uint32_t c;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        {len = 2; c = s[0] & 0x1f;}
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+        {len = 3; c = s[0] & 0x0f;}
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+        {len = 4; c = s[0] & 0x07;}
+    else
+        {return 0;}
+    if (len > n)
+        {return 0;}
+    for (i = 1; i < len; i++)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+            {return 0;}
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    // overlong, surrogate or past the last code point
+    if ((len == 3 && c < 0x800) || (len == 4 && c < 0x10000))
+        {return 0;}
+    if ((c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+        {return 0;}
+    return len;
+}
+
+#ifdef HAVE_SIMD
+__attribute__((target("sse2")))
+size_t clean_sse2(const unsigned char* s, size_t n, int slash)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i fslash = _mm_set1_epi8(slash ? '/' : '"');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    __m128i v, hit;
+    unsigned mask;
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i*)(s + i));
+        // unsigned v <= 0x1f is min(v, 0x1f) == v
+        hit = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, quote));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, bslash));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, fslash));
+        mask = _mm_movemask_epi8(hit) | _mm_movemask_epi8(v);
+        if (mask)
+            {return i + __builtin_ctz(mask);}
+    }
+    return i + clean_scalar(s + i, n - i, slash);
+}
+
+__attribute__((target("avx2")))
+size_t clean_avx2(const unsigned char* s, size_t n, int slash)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i fslash = _mm256_set1_epi8(slash ? '/' : '"');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    __m256i v, hit;
+    unsigned mask;
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i*)(s + i));
+        hit = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, quote));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, bslash));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, fslash));
+        mask = _mm256_movemask_epi8(hit) | _mm256_movemask_epi8(v);
+        if (mask)
+            {return i + __builtin_ctz(mask);}
+    }
+    return i + clean_sse2(s + i, n - i, slash);
+}
+#endif
+
+size_t (*clean_run)(const unsigned char*, size_t, int) = NULL;
+
+void pick_clean_run()
+{
+    clean_run = clean_scalar;
+#ifdef HAVE_SIMD
+    if (simd_level() >= 1)
+        {clean_run = clean_sse2;}
+    if (simd_level() >= 2)
+        {clean_run = clean_avx2;}
+#endif
+}
+
+int dump_string(const char* str, size_t n, int flags, out_sink* sink)
+{
+    const unsigned char* s = (const unsigned char*)str;
+    int slash = flags & JSON_ESCAPE_SLASH;
+    char seq[8];
+    const char* text;
+    size_t run, len;
+    if (sink_write("\"", 1, sink))
+        {return -1;}
+    while (1)
+    {
+        // keys and short values are not worth a vector pass
+        run = n < 32 ? clean_scalar(s, n, slash) : clean_run(s, n, slash);
+        if (run && sink_write((const char*)s, run, sink))
+            {return -1;}
+        if (run == n)
+            {break;}
+        if (s[run] >= 0x80)
+        {
+            // jansson refuses to write broken utf-8 as well
+            len = utf8_length(s + run, n - run);
+            if (!len || sink_write((const char*)s + run, len, sink))
+                {return -1;}
+            s += run + len;
+            n -= run + len;
+            continue;
+        }
+        switch (s[run])
+        {
+            case '\\': text = "\\\\"; break;
+            case '"':  text = "\\\""; break;
+            case '\b': text = "\\b"; break;
+            case '\f': text = "\\f"; break;
+            case '\n': text = "\\n"; break;
+            case '\r': text = "\\r"; break;
+            case '\t': text = "\\t"; break;
+            case '/':  text = "\\/"; break;
+            default:
+                snprintf(seq, sizeof(seq), "\\u%04X", s[run]);
+                text = seq;
+                break;
+        }
+        if (sink_write(text, strlen(text), sink))
+            {return -1;}
+        s += run + 1;
+        n -= run + 1;
+    }
+    return sink_write("\"", 1, sink);
+}
+
+int dump_indent(int flags, int depth, int space, out_sink* sink)
+{
+    static const char spaces[] = "\n                                ";
+    size_t n = (JSON_INDENT(0x1f) & flags) * depth;
+    size_t chunk;
+    if (JSON_INDENT(0x1f) & flags)
+    {
+        // the newline and up to 32 spaces in one write
+        chunk = MIN(n, sizeof(spaces) - 2);
+        if (sink_write(spaces, chunk + 1, sink))
+            {return -1;}
+        for (n -= chunk; n > 0; n -= chunk)
+        {
+            chunk = MIN(n, sizeof(spaces) - 2);
+            if (sink_write(spaces + 1, chunk, sink))
+                {return -1;}
+        }
+        return 0;
+    }
+    if (space && !(flags & JSON_COMPACT))
+        {return sink_write(" ", 1, sink);}
+    return 0;
+}
+
+typedef struct
+{
+    const char* key;
+    size_t len;
+    json_t* value;
+} dump_key;
+
+int compare_dump_keys(const void* a, const void* b)
+// jansson's order for JSON_SORT_KEYS, bytewise then by length
+{
+    const dump_key* k1 = a;
+    const dump_key* k2 = b;
+    int r = memcmp(k1->key, k2->key, MIN(k1->len, k2->len));
+    if (r)
+        {return r;}
+    return (k1->len > k2->len) - (k1->len < k2->len);
+}
+
+typedef struct
+{
+    out_sink* sink;
+    int flags;
+    int depth;
+} deep_sink;
+
+int deep_write(const char* buffer, size_t size, void* data)
+// jansson's output for a subtree, every line moved over to its depth
+{
+    deep_sink* deep = data;
+    const char* nl;
+    while ((nl = memchr(buffer, '\n', size)))
+    {
+        if (sink_write(buffer, nl - buffer, deep->sink) || dump_indent(deep->flags, deep->depth, 0, deep->sink))
+            {return -1;}
+        size -= nl + 1 - buffer;
+        buffer = nl + 1;
+    }
+    return sink_write(buffer, size, deep->sink);
+}
+
+int dump_tree(json_t* json, int flags, int depth, out_sink* sink)
+{
+    const char* sep = (flags & JSON_COMPACT) ? ":" : ": ";
+    char buf[32];
+    dump_key* keys;
+    void* iter;
+    size_t i, n;
+    deep_sink deep;
+    int r = 0;
+
+    if (depth > DUMPDEPTH)
+    {
+        deep.sink = sink;
+        deep.flags = flags;
+        deep.depth = depth;
+        return json_dump_callback(json, deep_write, &deep, flags | JSON_ENCODE_ANY);
+    }
+    switch (json_typeof(json))
+    {
+        case JSON_STRING:
+            return dump_string(json_string_value(json), json_string_length(json), flags, sink);
+        case JSON_INTEGER:
+            n = snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT, json_integer_value(json));
+            return sink_write(buf, n, sink);
+        case JSON_REAL:
+            // rare next to strings, leave the float formatting to jansson
+            return json_dump_callback(json, sink_write, sink, flags | JSON_ENCODE_ANY);
+        case JSON_TRUE:
+            return sink_write("true", 4, sink);
+        case JSON_FALSE:
+            return sink_write("false", 5, sink);
+        case JSON_NULL:
+            return sink_write("null", 4, sink);
+        case JSON_ARRAY:
+            n = json_array_size(json);
+            if (sink_write("[", 1, sink))
+                {return -1;}
+            if (n == 0)
+                {return sink_write("]", 1, sink);}
+            if (dump_indent(flags, depth + 1, 0, sink))
+                {return -1;}
+            for (i = 0; i < n; i++)
+            {
+                if (dump_tree(json_array_get(json, i), flags, depth + 1, sink))
+                    {return -1;}
+                if (i < n - 1)
+                    {r = sink_write(",", 1, sink) || dump_indent(flags, depth + 1, 1, sink);}
+                else
+                    {r = dump_indent(flags, depth, 0, sink);}
+                if (r)
+                    {return -1;}
+            }
+            return sink_write("]", 1, sink);
+        case JSON_OBJECT:
+            n = json_object_size(json);
+            if (sink_write("{", 1, sink))
+                {return -1;}
+            if (n == 0)
+                {return sink_write("}", 1, sink);}
+            if (dump_indent(flags, depth + 1, 0, sink))
+                {return -1;}
+            if (!(flags & JSON_SORT_KEYS))
+            {
+                // insertion order, straight off the iterator
+                for (iter = json_object_iter(json); iter && !r; iter = json_object_iter_next(json, iter))
+                {
+                    r = dump_string(json_object_iter_key(iter), json_object_iter_key_len(iter), flags, sink);
+                    r = r || sink_write(sep, strlen(sep), sink);
+                    r = r || dump_tree(json_object_iter_value(iter), flags, depth + 1, sink);
+                    if (json_object_iter_next(json, iter))
+                        {r = r || sink_write(",", 1, sink) || dump_indent(flags, depth + 1, 1, sink);}
+                    else
+                        {r = r || dump_indent(flags, depth, 0, sink);}
+                }
+                if (r)
+                    {return -1;}
+                return sink_write("}", 1, sink);
+            }
+            keys = malloc(n * sizeof(dump_key));
+            if (!keys)
+                {hard_err("internal error: out of memory");}
+            i = 0;
+            for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+            {
+                keys[i].key = json_object_iter_key(iter);
+                keys[i].len = json_object_iter_key_len(iter);
+                keys[i].value = json_object_iter_value(iter);
+                i++;
+            }
+            qsort(keys, n, sizeof(dump_key), compare_dump_keys);
+            for (i = 0; i < n && !r; i++)
+            {
+                r = dump_string(keys[i].key, keys[i].len, flags, sink) || sink_write(sep, strlen(sep), sink);
+                r = r || dump_tree(keys[i].value, flags, depth + 1, sink);
+                if (i < n - 1)
+                    {r = r || sink_write(",", 1, sink) || dump_indent(flags, depth + 1, 1, sink);}
+                else
+                    {r = r || dump_indent(flags, depth, 0, sink);}
+            }
+            free(keys);
+            if (r)
+                {return -1;}
+            return sink_write("}", 1, sink);
+        default:
+            return -1;
+    }
+}
+
+void smart_dumpf(json_t* json, int flags, FILE* fp)
+// streams to fp as it serializes instead of building the whole string
+{
+    static out_sink sink;
+    int r;
+    if (!flags)
+        {flags = dumps_flags;}
+    if (!clean_run)
+        {pick_clean_run();}
+    sink.fp = fp;
+    sink.len = 0;
+    if (flags & JSON_ENSURE_ASCII)
+        {r = json_dump_callback(json, sink_write, &sink, flags | JSON_ENCODE_ANY);}
+    else
+        {r = dump_tree(json, flags, 0, &sink);}
+    if (r || sink_flush(&sink))
+        {err("error: failed to write output");}
+}
+#else
+void smart_dumpf(json_t* json, int flags, FILE* fp)
+// streams to fp as it serializes instead of building the whole string
+{
+    static out_sink sink;
+    if (!flags)
+        {flags = dumps_flags;}
+    sink.fp = fp;
+    sink.len = 0;
+    if (json_dump_callback(json, sink_write, &sink, flags | JSON_ENCODE_ANY) || sink_flush(&sink))
+        {err("error: failed to write output");}
+}
+#endif
+#endif
+
+/*char* pretty_dumps(json_t* json)
+// underscore-style colorizing
+// needs a more or less rewrite of dumps()
+{
+    int depth = 0;
+    // loop over everything
+    // needs a stack
+    // number, orange
+    // string, green
+    // null, bold white
+    // string, purple?
+}*/
+
+#if JANSSON_VERSION_HEX < 0x020300
+json_t* smart_loads(char* j_string)
+// json_loads is broken on simple types
+{
+    json_t* json;
+    json_error_t error;
+    char *temp;
+    int i;
+    i = asprintf(&temp, "[%s]", j_string);
     if (i == -1)
         {hard_err("internal error: out of memory");}
+    json = compat_json_loads(temp, &error);
+    if (!json)
+        {return json_string(j_string);}
+    return json_array_get(json, 0);
+}
+#else
+json_t* smart_loads(char* j_string)
+{
+    json_error_t error;
+    return json_loads(j_string, JSON_DECODE_ANY, &error);
+}
+#endif
+
+char* pretty_type(json_t* json)
+{
+    if (json == NULL)
+        {err("internal error: null pointer"); return "NULL";}
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+            return "object";
+        case JSON_ARRAY:
+            return "array";
+        case JSON_STRING:
+            return "string";
+        case JSON_INTEGER:
+        case JSON_REAL:
+            return "number";
+        case JSON_TRUE:
+        case JSON_FALSE:
+            return "bool";
+        case JSON_NULL:
+            return "null";
+        default:
+            err("internal error: unknown type");
+            return "NULL";
+    }
+}
+
+void json_err(char* message, json_t* json)
+{
+    static char* temp = NULL;
+    int i;
+    free(temp);
+    i = asprintf(&temp, "parse error: type '%s' %s (arg %i)", pretty_type(json), message, optind-1);
+    if (i == -1)
+    {
+        temp = NULL;
+        hard_err("internal error: out of memory");
+    }
     err(temp);
 }
 
@@ -665,7 +1703,7 @@ void keys(json_t* json)
         {qsort(keys, n, sizeof(char*), compare_strcmp);}
 
     for (i = 0; i < n; ++i)
-        {printf("%s\n", keys[i]);}
+        {fprintf(out, "%s\n", keys[i]);}
 
     free(keys);
 }
@@ -836,136 +1874,4119 @@ json_t* update(json_t* json, char* key, char* j_string)
     return update_native(json, key, smart_loads(j_string));
 }
 
-void debug_stack(int optchar)
+// binary formats (-A, -O)
+// cbor (rfc 8949) and messagepack, so jshon stages can pass documents
+// to each other without printing and reparsing text.  only what maps
+// onto json is supported: no byte strings, extensions or non-string keys.
+
+#define FORMAT_AUTO    'a'
+#define FORMAT_JSON    'j'
+#define FORMAT_CBOR    'c'
+#define FORMAT_MSGPACK 'm'
+
+// nesting limit for binary input, same as jansson's
+#define BINARYDEPTH 2048
+
+char in_format = FORMAT_AUTO;
+char out_format = FORMAT_JSON;
+
+char parse_format(char* arg, int allow_auto)
 {
-    json_t** j;
-    printf("BEGIN STACK DUMP %c\n", optchar);
-    for (j=stack; j<stackpointer; j++)
-        {printf("%s\n", smart_dumps(*j, 0));}
+    if (!strcmp(arg, "json"))
+        {return FORMAT_JSON;}
+    if (!strcmp(arg, "cbor"))
+        {return FORMAT_CBOR;}
+    if (!strcmp(arg, "msgpack"))
+        {return FORMAT_MSGPACK;}
+    if (allow_auto && !strcmp(arg, "auto"))
+        {return FORMAT_AUTO;}
+    arg_err("parse error: unknown format on arg %i, \"%s\"");
+    return allow_auto ? FORMAT_AUTO : FORMAT_JSON;
 }
 
-void debug_map()
+char detect_format(const char* content, size_t len)
+// cbor written by jshon starts with the self-describe tag 55799.
+// msgpack is only guessed from a map, array or string marker, bytes
+// that can not start json text; everything else stays json
 {
-    mapping* m;
-    printf("BEGIN MAP DUMP\n");
-    for (m=mapstack; m<mapstackpointer; m++)
-        {printf("%s\n", smart_dumps(*(m->stk), 0));}
+    const unsigned char* p = (const unsigned char*)content;
+    if (len >= 3 && p[0] == 0xd9 && p[1] == 0xd9 && p[2] == 0xf7)
+        {return FORMAT_CBOR;}
+    if (len && ((p[0] >= 0x80 && p[0] <= 0xbf) || (p[0] >= 0xd9 && p[0] <= 0xdf)))
+        {return FORMAT_MSGPACK;}
+    return FORMAT_JSON;
 }
 
-int main (int argc, char *argv[])
-#define ALL_OPTIONS "PSQVCI0tlkupajF:e:s:n:d:i:"
+const char** sorted_members(json_t* json)
+// object keys in output order, the caller frees the array
 {
-    char* content = "";
-    char* arg1 = "";
-    FILE* fp;
-    json_t* json = NULL;
-    json_t* jval = NULL;
-    json_error_t error;
-    int output = 1;  // flag if json should be printed
-    int optchar;
-    int jsonp = 0;   // flag if we should tolerate JSONP wrapping
-    int jsonp_rows = 0, jsonp_cols = 0;   // rows+cols skipped over by JSONP prologue
-    int empty;
-    g_argv = argv;
+    const char** keys;
+    void* iter;
+    size_t n = 0;
+    keys = malloc(sizeof(char*) * (json_object_size(json) + 1));
+    if (!keys)
+        {hard_err("internal error: out of memory");}
+    for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+        {keys[n++] = json_object_iter_key(iter);}
+    if (dumps_flags & JSON_SORT_KEYS)
+        {qsort(keys, n, sizeof(char*), compare_strcmp);}
+    return keys;
+}
 
-    // todo: get more jsonp stuff out of main
+void put_be(uint64_t v, int bytes, FILE* fp)
+{
+    while (bytes--)
+        {fputc((v >> (bytes * 8)) & 0xff, fp);}
+}
 
-    // avoiding getopt_long for now because the BSD version is a pain
-    if (argc == 2 && strncmp(argv[1], "--version", 9) == 0)
-        {printf("%i\n", JSHONVER); exit(0);}
+int width(uint64_t v)
+// smallest of 1, 2, 4 or 8 bytes that holds v
+{
+    if (v <= 0xff)
+        {return 1;}
+    if (v <= 0xffff)
+        {return 2;}
+    if (v <= 0xffffffffULL)
+        {return 4;}
+    return 8;
+}
 
-    // non-manipulation options
-    while ((optchar = getopt(argc, argv, ALL_OPTIONS)) != -1)
+int width_code(int bytes)
+// 1, 2, 4, 8 -> 0, 1, 2, 3
+{
+    return bytes == 1 ? 0 : bytes == 2 ? 1 : bytes == 4 ? 2 : 3;
+}
+
+void cbor_head(int major, uint64_t v, FILE* fp)
+{
+    int bytes = width(v);
+    if (v < 24)
     {
-        switch (optchar)
-        {
-            case 'P':
-                jsonp = 1;
-                break;
-            case 'S':
-                dumps_flags &= ~JSON_PRESERVE_ORDER;
-                dumps_flags |= JSON_SORT_KEYS;
-                dumps_compact &= ~JSON_PRESERVE_ORDER;
-                dumps_compact |= JSON_SORT_KEYS;
-                break;
-            case 'Q':
-                quiet = 1;
-                break;
-            case 'V':
-                by_value = 1;
-                break;
-            case 'C':
-                crash = 0;
-                break;
-            case 'I':
-                in_place = 1;
-                break;
-            case 'F':
-                file_path = (char*) strdup(optarg);
-                break;
-            case '0':
-                delim = '\0';
-                break;
-            case 't':
-            case 'l':
-            case 'k':
-            case 'u':
-            case 'p':
-            case 'e':
-            case 'j':
-            case 's':
-            case 'n':
-            case 'd':
-            case 'i':
-            case 'a':
-                break;
-            default:
-                if (!quiet)
-                    {fprintf(stderr, "Valid: -[P|S|Q|V|C|I|0] [-F path] -[t|l|k|u|p|a|j] -[s|n] value -[e|i|d] index\n");}
-                if (crash)
-                    {exit(2);}
-                break;
-        }
+        fputc((major << 5) | v, fp);
+        return;
+    }
+    fputc((major << 5) | (24 + width_code(bytes)), fp);
+    put_be(v, bytes, fp);
+}
+
+void msgpack_head(int fix, uint64_t fixmax, int base, uint64_t v, FILE* fp)
+// fix form when it fits, otherwise the sized forms starting at base
+// strings have an 8 bit form, containers start at 16 bits
+{
+    int bytes = width(v);
+    if (v <= fixmax)
+    {
+        fputc(fix | v, fp);
+        return;
+    }
+    if (base != 0xd9 && bytes == 1)
+        {bytes = 2;}
+    fputc(base + width_code(bytes) - (base != 0xd9), fp);
+    put_be(v, bytes, fp);
+}
+
+void binary_dump(json_t* json, char format, FILE* fp)
+{
+    const char** keys;
+    const char* s;
+    json_int_t i;
+    uint64_t bits;
+    double d;
+    size_t k, n;
+
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+            n = json_object_size(json);
+            if (format == FORMAT_CBOR)
+                {cbor_head(5, n, fp);}
+            else
+                {msgpack_head(0x80, 15, 0xde, n, fp);}
+            keys = sorted_members(json);
+            for (k = 0; k < n; k++)
+            {
+                if (format == FORMAT_CBOR)
+                    {cbor_head(3, strlen(keys[k]), fp);}
+                else
+                    {msgpack_head(0xa0, 31, 0xd9, strlen(keys[k]), fp);}
+                fputs(keys[k], fp);
+                binary_dump(json_object_get(json, keys[k]), format, fp);
+            }
+            free(keys);
+            return;
+        case JSON_ARRAY:
+            n = json_array_size(json);
+            if (format == FORMAT_CBOR)
+                {cbor_head(4, n, fp);}
+            else
+                {msgpack_head(0x90, 15, 0xdc, n, fp);}
+            for (k = 0; k < n; k++)
+                {binary_dump(json_array_get(json, k), format, fp);}
+            return;
+        case JSON_STRING:
+            s = json_string_value(json);
+            n = strlen(s);
+            if (format == FORMAT_CBOR)
+                {cbor_head(3, n, fp);}
+            else
+                {msgpack_head(0xa0, 31, 0xd9, n, fp);}
+            fwrite(s, 1, n, fp);
+            return;
+        case JSON_INTEGER:
+            i = json_integer_value(json);
+            if (format == FORMAT_CBOR)
+            {
+                if (i >= 0)
+                    {cbor_head(0, i, fp);}
+                else
+                    {cbor_head(1, (uint64_t)(-(i + 1)), fp);}
+            }
+            else if (i >= 0 && i < 128)
+                {fputc(i, fp);}
+            else if (i >= 0)
+            {
+                k = width(i);
+                fputc(0xcc + width_code(k), fp);
+                put_be(i, k, fp);
+            }
+            else if (i >= -32)
+                {fputc(i & 0xff, fp);}
+            else
+            {
+                // signed width, from the magnitude of -(i + 1)
+                k = width((uint64_t)(-(i + 1)) << 1);
+                fputc(0xd0 + width_code(k), fp);
+                put_be((uint64_t)i, k, fp);
+            }
+            return;
+        case JSON_REAL:
+            d = json_real_value(json);
+            memcpy(&bits, &d, sizeof(bits));
+            fputc(format == FORMAT_CBOR ? 0xfb : 0xcb, fp);
+            put_be(bits, 8, fp);
+            return;
+        case JSON_TRUE:
+            fputc(format == FORMAT_CBOR ? 0xf5 : 0xc3, fp);
+            return;
+        case JSON_FALSE:
+            fputc(format == FORMAT_CBOR ? 0xf4 : 0xc2, fp);
+            return;
+        case JSON_NULL:
+        default:
+            fputc(format == FORMAT_CBOR ? 0xf6 : 0xc0, fp);
+            return;
+    }
+}
+
+void write_document(json_t* json, FILE* fp)
+// the final output, json text or one binary item
+{
+    if (out_format == FORMAT_JSON)
+    {
+        smart_dumpf(json, 0, fp);
+        fputc('\n', fp);
+        return;
+    }
+    if (out_format == FORMAT_CBOR)
+        {put_be(0xd9d9f7, 3, fp);}
+    binary_dump(json, out_format, fp);
+}
+
+typedef struct
+{
+    const unsigned char* start;
+    const unsigned char* p;
+    const unsigned char* end;
+    char format;
+    const char* error;  // first problem found
+} binary_input;
+
+#define BINARY_FAIL(in, msg) do { if (!(in)->error) {(in)->error = (msg);} return NULL; } while (0)
+
+int get_be(binary_input* in, int bytes, uint64_t* v)
+{
+    if (in->end - in->p < bytes)
+    {
+        in->error = "unexpected end of input";
+        return -1;
+    }
+    *v = 0;
+    while (bytes--)
+        {*v = (*v << 8) | *in->p++;}
+    return 0;
+}
+
+double float_bits(uint64_t v)
+{
+    uint32_t bits = v;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+double double_bits(uint64_t v)
+{
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+double half_bits(uint64_t h)
+// widen through the single precision layout
+{
+    uint64_t sign = (h & 0x8000) << 16;
+    uint64_t exp = (h >> 10) & 0x1f;
+    uint64_t mant = h & 0x3ff;
+    if (exp == 0)
+        {return (sign ? -1.0 : 1.0) * mant / 16777216.0;}
+    if (exp == 31)
+        {return float_bits(sign | 0x7f800000 | (mant << 13));}
+    return float_bits(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+json_t* binary_number(binary_input* in, uint64_t v, int negative)
+{
+    if (v > (uint64_t)INT64_MAX)
+        {BINARY_FAIL(in, "integer out of range");}
+    return json_integer(negative ? -(json_int_t)v - 1 : (json_int_t)v);
+}
+
+json_t* binary_real(binary_input* in, double d)
+{
+    json_t* json = json_real(d);
+    if (json == NULL)
+        {BINARY_FAIL(in, "number is not finite");}
+    return json;
+}
+
+json_t* binary_string(binary_input* in, uint64_t n)
+{
+    char* temp;
+    json_t* json;
+    if ((uint64_t)(in->end - in->p) < n)
+        {BINARY_FAIL(in, "unexpected end of input");}
+    temp = strndup((const char*)in->p, n);
+    if (!temp)
+        {hard_err("internal error: out of memory");}
+    if (strlen(temp) != n)
+    {
+        free(temp);
+        BINARY_FAIL(in, "nul byte in string");
+    }
+    in->p += n;
+    json = json_string(temp);
+    free(temp);
+    if (json == NULL)
+        {BINARY_FAIL(in, "invalid utf-8 in string");}
+    return json;
+}
+
+json_t* binary_item(binary_input* in, int depth);
+
+json_t* binary_container(binary_input* in, int object, uint64_t n, int indefinite, int depth)
+// cbor indefinite containers end at a break byte
+{
+    json_t* json = object ? json_object() : json_array();
+    json_t* key;
+    json_t* value;
+    uint64_t i;
+    for (i = 0; indefinite || i < n; i++)
+    {
+        if (indefinite && in->p < in->end && *in->p == 0xff)
+        {
+            in->p++;
+            break;
+        }
+        key = NULL;
+        if (object)
+        {
+            key = binary_item(in, depth + 1);
+            if (key && !json_is_string(key))
+            {
+                json_decref(key);
+                key = NULL;
+                in->error = "object keys must be strings";
+            }
+            if (key == NULL)
+            {
+                json_decref(json);
+                return NULL;
+            }
+        }
+        value = binary_item(in, depth + 1);
+        if (value == NULL)
+        {
+            json_decref(key);
+            json_decref(json);
+            return NULL;
+        }
+        if (object)
+            {json_object_set_new(json, json_string_value(key), value);}
+        else
+            {json_array_append_new(json, value);}
+        json_decref(key);
+    }
+    return json;
+}
+
+json_t* cbor_item(binary_input* in, int depth)
+{
+    int major, info;
+    uint64_t v = 0;
+    json_t* json;
+    json_t* chunk;
+    char* joined;
+    char* temp;
+
+    if (in->p >= in->end)
+        {BINARY_FAIL(in, "unexpected end of input");}
+    major = *in->p >> 5;
+    info = *in->p++ & 0x1f;
+    if (info >= 24 && info <= 27 && get_be(in, 1 << (info - 24), &v))
+        {return NULL;}
+    if (info < 24)
+        {v = info;}
+    if (info >= 28 && info <= 30)
+        {BINARY_FAIL(in, "reserved cbor encoding");}
+    if (info == 31 && (major == 0 || major == 1 || major == 6))
+        {BINARY_FAIL(in, "bad indefinite length");}
+
+    switch (major)
+    {
+        case 0:
+        case 1:
+            return binary_number(in, v, major == 1);
+        case 2:
+            BINARY_FAIL(in, "byte strings are not supported");
+        case 3:
+            if (info != 31)
+                {return binary_string(in, v);}
+            // indefinite text, a series of definite chunks
+            joined = strdup("");
+            while (joined && in->p < in->end && *in->p != 0xff)
+            {
+                if ((*in->p >> 5) != 3 || (*in->p & 0x1f) == 31)
+                    {in->error = "bad string chunk";}
+                chunk = in->error ? NULL : cbor_item(in, depth + 1);
+                if (chunk == NULL)
+                {
+                    free(joined);
+                    return NULL;
+                }
+                if (asprintf(&temp, "%s%s", joined, json_string_value(chunk)) == -1)
+                    {hard_err("internal error: out of memory");}
+                free(joined);
+                json_decref(chunk);
+                joined = temp;
+            }
+            if (joined == NULL)
+                {hard_err("internal error: out of memory");}
+            if (in->p >= in->end)
+            {
+                free(joined);
+                BINARY_FAIL(in, "unexpected end of input");
+            }
+            in->p++;
+            json = json_string(joined);
+            free(joined);
+            return json;
+        case 4:
+        case 5:
+            return binary_container(in, major == 5, v, info == 31, depth);
+        case 6:
+            // tags carry no meaning for json, keep the tagged item
+            return binary_item(in, depth + 1);
+        case 7:
+        default:
+            switch (info)
+            {
+                case 20:
+                    return json_false();
+                case 21:
+                    return json_true();
+                case 22:
+                case 23:
+                    return json_null();
+                case 25:
+                    return binary_real(in, half_bits(v));
+                case 26:
+                    return binary_real(in, float_bits(v));
+                case 27:
+                    return binary_real(in, double_bits(v));
+                default:
+                    BINARY_FAIL(in, "unsupported simple value");
+            }
+    }
+}
+
+json_t* msgpack_item(binary_input* in, int depth)
+{
+    int b;
+    uint64_t v;
+
+    if (in->p >= in->end)
+        {BINARY_FAIL(in, "unexpected end of input");}
+    b = *in->p++;
+    if (b <= 0x7f)
+        {return json_integer(b);}
+    if (b >= 0xe0)
+        {return json_integer(b - 0x100);}
+    if (b <= 0x8f)
+        {return binary_container(in, 1, b & 0x0f, 0, depth);}
+    if (b <= 0x9f)
+        {return binary_container(in, 0, b & 0x0f, 0, depth);}
+    if (b <= 0xbf)
+        {return binary_string(in, b & 0x1f);}
+    switch (b)
+    {
+        case 0xc0:
+            return json_null();
+        case 0xc2:
+            return json_false();
+        case 0xc3:
+            return json_true();
+        case 0xca:
+            if (get_be(in, 4, &v))
+                {return NULL;}
+            return binary_real(in, float_bits(v));
+        case 0xcb:
+            if (get_be(in, 8, &v))
+                {return NULL;}
+            return binary_real(in, double_bits(v));
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            if (get_be(in, 1 << (b - 0xcc), &v))
+                {return NULL;}
+            return binary_number(in, v, 0);
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+            if (get_be(in, 1 << (b - 0xd0), &v))
+                {return NULL;}
+            // sign extend from the encoded width
+            b = 64 - (8 << (b - 0xd0));
+            return json_integer((json_int_t)(v << b) >> b);
+        case 0xd9:
+        case 0xda:
+        case 0xdb:
+            if (get_be(in, 1 << (b - 0xd9), &v))
+                {return NULL;}
+            return binary_string(in, v);
+        case 0xdc:
+        case 0xdd:
+            if (get_be(in, 2 << (b - 0xdc), &v))
+                {return NULL;}
+            return binary_container(in, 0, v, 0, depth);
+        case 0xde:
+        case 0xdf:
+            if (get_be(in, 2 << (b - 0xde), &v))
+                {return NULL;}
+            return binary_container(in, 1, v, 0, depth);
+        default:
+            BINARY_FAIL(in, "binary and extension types are not supported");
+    }
+}
+
+json_t* binary_item(binary_input* in, int depth)
+{
+    if (depth > BINARYDEPTH)
+        {BINARY_FAIL(in, "maximum nesting depth reached");}
+    if (in->format == FORMAT_CBOR)
+        {return cbor_item(in, depth);}
+    return msgpack_item(in, depth);
+}
+
+json_t* binary_loads(const char* content, size_t len, char format, int guessed)
+// exits with a message on bad input, like a json read error.
+// a guessed format returns NULL instead, the input is then read as json
+{
+    binary_input in;
+    json_t* json;
+    in.start = in.p = (const unsigned char*)content;
+    in.end = in.p + len;
+    in.format = format;
+    in.error = NULL;
+    json = binary_item(&in, 0);
+    if (json && in.p != in.end)
+    {
+        json_decref(json);
+        json = NULL;
+        in.error = "extra data after the document";
+    }
+    if (json == NULL && !guessed)
+    {
+        if (!quiet)
+        {
+            fprintf(errout, "%s read error: byte %zu: %s\n", format == FORMAT_CBOR ? "cbor" : "msgpack",
+                    (size_t)(in.p - in.start), in.error ? in.error : "invalid input");
+        }
+        exit(1);
+    }
+    return json;
+}
+
+// hashed lookups for -x
+// an index maps the printable value of one field to the first array
+// position holding it.  built on first use and kept until the next edit.
+
+typedef struct
+{
+    json_t*   array;  // indexed array, not owned
+    char*     field;
+    uint64_t* hash;   // 0 marks an empty slot
+    size_t*   pos;
+    size_t    size;   // slot count, power of two
+} field_index;
+
+#define INDEXCACHE 16
+
+field_index indexes[INDEXCACHE];
+int index_count = 0;
+
+uint64_t hash_bytes(const char* s, size_t n)
+// fnv-1a, never returns the empty slot marker
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (n--)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+const char* index_key(json_t* element, char* field, char* buf, size_t n)
+// printable field value as -u would show it, or NULL if it has none
+{
+    json_t* json;
+    char* temp;
+    if (!json_is_object(element))
+        {return NULL;}
+    json = json_object_get(element, field);
+    if (json == NULL)
+        {return NULL;}
+    switch (json_typeof(json))
+    {
+        case JSON_STRING:
+            return json_string_value(json);
+        case JSON_INTEGER:
+            snprintf(buf, n, "%" JSON_INTEGER_FORMAT, json_integer_value(json));
+            return buf;
+        case JSON_REAL:
+            // the same text -u prints, 2.0 and not 2
+            temp = smart_dumps(json, 0);
+            snprintf(buf, n, "%s", temp);
+            free(temp);
+            return buf;
+        case JSON_TRUE:
+            return "true";
+        case JSON_FALSE:
+            return "false";
+        case JSON_NULL:
+            return "null";
+        case JSON_OBJECT:
+        case JSON_ARRAY:
+        default:
+            return NULL;
+    }
+}
+
+void index_reset()
+// any edit may invalidate positions or field values
+{
+    int i;
+    for (i = 0; i < index_count; i++)
+    {
+        json_decref(indexes[i].array);
+        free(indexes[i].field);
+        free(indexes[i].hash);
+        free(indexes[i].pos);
+    }
+    index_count = 0;
+}
+
+field_index* index_build(json_t* array, char* field)
+{
+    field_index* idx;
+    const char* key;
+    const char* other;
+    char buf[64], buf2[64];
+    size_t i, slot, n, mask;
+    uint64_t h;
+
+    for (i = 0; i < (size_t)index_count; i++)
+    {
+        if (indexes[i].array == array && !strcmp(indexes[i].field, field))
+            {return &indexes[i];}
+    }
+    if (index_count == INDEXCACHE)
+        {index_reset();}
+    idx = &indexes[index_count++];
+
+    n = json_array_size(array);
+    // held so the address can not be reused by another array
+    idx->array = json_incref(array);
+    idx->size = 16;
+    while (idx->size < n * 2)
+        {idx->size *= 2;}
+    idx->field = strdup(field);
+    idx->hash = calloc(idx->size, sizeof(uint64_t));
+    idx->pos = malloc(idx->size * sizeof(size_t));
+    if (!idx->field || !idx->hash || !idx->pos)
+        {hard_err("internal error: out of memory");}
+
+    mask = idx->size - 1;
+    for (i = 0; i < n; i++)
+    {
+        key = index_key(json_array_get(array, i), field, buf, sizeof(buf));
+        if (key == NULL)
+            {continue;}
+        h = hash_bytes(key, strlen(key));
+        // linear probing, the first occurrence of a value wins
+        for (slot = h & mask; idx->hash[slot]; slot = (slot + 1) & mask)
+        {
+            if (idx->hash[slot] != h)
+                {continue;}
+            other = index_key(json_array_get(array, idx->pos[slot]), field, buf2, sizeof(buf2));
+            if (other && !strcmp(key, other))
+                {break;}
+        }
+        if (idx->hash[slot])
+            {continue;}
+        idx->hash[slot] = h;
+        idx->pos[slot] = i;
+    }
+    return idx;
+}
+
+json_t* lookup(json_t* json, char* arg)
+// arg is field=value, finds the first element with that field value
+{
+    field_index* idx;
+    char* field;
+    char* value;
+    const char* key;
+    char buf[64];
+    size_t slot, mask;
+    uint64_t h;
+
+    if (!json_is_array(json))
+        {json_err("has no elements to look up", json); return json_null();}
+    value = strchr(arg, '=');
+    if (value == NULL)
+    {
+        arg_err("parse error: lookup needs field=value on arg %i, \"%s\"");
+        return json_null();
+    }
+    field = strndup(arg, value - arg);
+    value++;
+
+    idx = index_build(json, field);
+    free(field);
+    h = hash_bytes(value, strlen(value));
+    mask = idx->size - 1;
+    for (slot = h & mask; idx->hash[slot]; slot = (slot + 1) & mask)
+    {
+        if (idx->hash[slot] != h)
+            {continue;}
+        key = index_key(json_array_get(json, idx->pos[slot]), idx->field, buf, sizeof(buf));
+        if (key && !strcmp(key, value))
+            {return json_array_get(json, idx->pos[slot]);}
+    }
+    json_err("has no matching element", json);
+    return json_null();
+}
+
+// worker threads for the heavier actions (-T)
+
+#define MAXTHREADS 64
+
+int threads = 1;
+
+void run_parallel(void* (*fn)(void*), void* args, size_t argsize, int n)
+// calls fn once per argument block, each on its own thread, and waits
+{
+    pthread_t tid[MAXTHREADS];
+    int started[MAXTHREADS];
+    int i;
+    lean_locking = (lean || budget) && n > 1;
+    for (i = 1; i < n; i++)
+        {started[i] = !pthread_create(&tid[i], NULL, fn, (char*)args + i * argsize);}
+    fn(args);
+    for (i = 1; i < n; i++)
+    {
+        if (started[i])
+            {pthread_join(tid[i], NULL);}
+        else
+            {fn((char*)args + i * argsize);}
+    }
+    lean_locking = 0;
+}
+
+// content hashes of subtrees (-H, -D)
+// object members are combined with a sum, so key order does not matter.
+// container hashes are memoized, one table per thread, so a diff can
+// compare any two subtrees in constant time after one bottom-up pass.
+
+typedef struct
+{
+    json_t**  key;   // NULL marks an empty slot
+    uint64_t* val;
+    size_t    size;  // power of two
+    size_t    used;
+} hash_memo;
+
+hash_memo memos[MAXTHREADS];
+
+uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t memo_get(hash_memo* memo, json_t* json)
+{
+    size_t slot, mask;
+    if (memo->size == 0)
+        {return 0;}
+    mask = memo->size - 1;
+    for (slot = mix64((uintptr_t)json) & mask; memo->key[slot]; slot = (slot + 1) & mask)
+    {
+        if (memo->key[slot] == json)
+            {return memo->val[slot];}
+    }
+    return 0;
+}
+
+void memo_put(hash_memo* memo, json_t* json, uint64_t h)
+{
+    hash_memo bigger;
+    size_t i, slot, mask;
+    if (memo->used * 2 >= memo->size)
+    {
+        bigger.size = memo->size ? memo->size * 2 : 1024;
+        bigger.used = 0;
+        bigger.key = calloc(bigger.size, sizeof(json_t*));
+        bigger.val = malloc(bigger.size * sizeof(uint64_t));
+        if (!bigger.key || !bigger.val)
+            {hard_err("internal error: out of memory");}
+        for (i = 0; i < memo->size; i++)
+        {
+            if (memo->key[i])
+                {memo_put(&bigger, memo->key[i], memo->val[i]);}
+        }
+        free(memo->key);
+        free(memo->val);
+        *memo = bigger;
+    }
+    mask = memo->size - 1;
+    for (slot = mix64((uintptr_t)json) & mask; memo->key[slot]; slot = (slot + 1) & mask)
+        {;}
+    memo->key[slot] = json;
+    memo->val[slot] = h;
+    memo->used++;
+}
+
+void memo_reset()
+// edits change the hashes of the containers above them
+{
+    int i;
+    for (i = 0; i < MAXTHREADS; i++)
+    {
+        free(memos[i].key);
+        free(memos[i].val);
+        memset(&memos[i], 0, sizeof(hash_memo));
+    }
+}
+
+// subtrees smaller than this are cheaper to rehash than to look up
+#define MEMOMIN 16
+
+uint64_t tree_hash_sized(json_t* json, hash_memo* memo, int count, size_t* nodes)
+// looks in count tables, new hashes go into the first one
+{
+    const char* key;
+    void* iter;
+    uint64_t h;
+    double d;
+    size_t i, n, below = 0;
+    int m;
+
+    (*nodes)++;
+
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+        case JSON_ARRAY:
+            for (m = 0; m < count; m++)
+            {
+                if ((h = memo_get(&memo[m], json)))
+                    {return h;}
+            }
+            break;
+        default:
+            break;
+    }
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+            h = 0;
+            iter = json_object_iter(json);
+            while (iter)
+            {
+                key = json_object_iter_key(iter);
+                h += mix64(hash_bytes(key, strlen(key)) ^ tree_hash_sized(json_object_iter_value(iter), memo, count, &below));
+                iter = json_object_iter_next(json, iter);
+            }
+            h = mix64(h ^ 0x6f626a656374ULL);
+            break;
+        case JSON_ARRAY:
+            h = 0x6172726179ULL;
+            n = json_array_size(json);
+            for (i = 0; i < n; i++)
+                {h = mix64(h + tree_hash_sized(json_array_get(json, i), memo, count, &below));}
+            break;
+        case JSON_STRING:
+            key = json_string_value(json);
+            return mix64(hash_bytes(key, strlen(key)) ^ 0x737472696e67ULL) | 1;
+        case JSON_INTEGER:
+            return mix64((uint64_t)json_integer_value(json) ^ 0x696e74ULL) | 1;
+        case JSON_REAL:
+            d = json_real_value(json);
+            memcpy(&h, &d, sizeof(h));
+            return mix64(h ^ 0x7265616cULL) | 1;
+        case JSON_TRUE:
+            return mix64(0x74727565ULL);
+        case JSON_FALSE:
+            return mix64(0x66616c7365ULL);
+        case JSON_NULL:
+        default:
+            return mix64(0x6e756c6cULL);
+    }
+    h |= 1;
+    *nodes += below;
+    if (below >= MEMOMIN)
+        {memo_put(memo, json, h);}
+    return h;
+}
+
+uint64_t tree_hash(json_t* json, hash_memo* memo, int count)
+{
+    size_t nodes = 0;
+    return tree_hash_sized(json, memo, count, &nodes);
+}
+
+typedef struct
+{
+    json_t** tasks;
+    size_t   ntasks;
+    size_t*  next;   // shared work counter
+    hash_memo* memo;
+} hash_job;
+
+void* hash_worker(void* arg)
+{
+    hash_job* job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) < job->ntasks)
+        {tree_hash(job->tasks[i], job->memo, 1);}
+    return NULL;
+}
+
+size_t children(json_t* json, json_t** out)
+// containers directly below json, out may be NULL to only count
+{
+    void* iter;
+    json_t* child;
+    size_t i, n = 0;
+    if (json_is_object(json))
+    {
+        for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+        {
+            child = json_object_iter_value(iter);
+            if (!json_is_object(child) && !json_is_array(child))
+                {continue;}
+            if (out)
+                {out[n] = child;}
+            n++;
+        }
+    }
+    else if (json_is_array(json))
+    {
+        for (i = 0; i < json_array_size(json); i++)
+        {
+            child = json_array_get(json, i);
+            if (!json_is_object(child) && !json_is_array(child))
+                {continue;}
+            if (out)
+                {out[n] = child;}
+            n++;
+        }
+    }
+    return n;
+}
+
+uint64_t hash_all(json_t* root)
+// hashes independent subtrees on all threads, then the top levels
+{
+    hash_job jobs[MAXTHREADS];
+    json_t** tasks;
+    json_t** level;
+    size_t i, n, ntasks, next = 0;
+    int t;
+
+    n = children(root, NULL);
+    if (threads > 1 && n > 1)
+    {
+        level = malloc(n * sizeof(json_t*));
+        if (!level)
+            {hard_err("internal error: out of memory");}
+        children(root, level);
+        // go one level deeper when there are too few subtrees to share
+        ntasks = n;
+        tasks = level;
+        if (n < (size_t)threads * 4)
+        {
+            for (ntasks = 0, i = 0; i < n; i++)
+                {ntasks += children(level[i], NULL);}
+            if (!(tasks = malloc((ntasks + 1) * sizeof(json_t*))))
+                {hard_err("internal error: out of memory");}
+            for (ntasks = 0, i = 0; i < n; i++)
+                {ntasks += children(level[i], tasks + ntasks);}
+        }
+        for (t = 0; t < threads; t++)
+        {
+            jobs[t].tasks = tasks;
+            jobs[t].ntasks = ntasks;
+            jobs[t].next = &next;
+            jobs[t].memo = &memos[t];
+        }
+        run_parallel(hash_worker, jobs, sizeof(hash_job), threads);
+        if (tasks != level)
+            {free(tasks);}
+        free(level);
+    }
+    return tree_hash(root, memos, threads);
+}
+
+void print_path(char op, json_t* path)
+{
+    fprintf(out, "%c ", op);
+    smart_dumpf(path, dumps_compact, out);
+    fputc('\n', out);
+}
+
+void diff_walk(json_t* a, json_t* b, json_t* path)
+// identical subtrees are skipped on their hash alone
+{
+    const char* key;
+    void* iter;
+    size_t i, na, nb;
+
+    if (tree_hash(a, memos, threads) == tree_hash(b, memos, threads))
+        {return;}
+    if (json_typeof(a) != json_typeof(b) || !(json_is_object(a) || json_is_array(a)))
+        {print_path('~', path); return;}
+    if (json_is_object(a))
+    {
+        for (iter = json_object_iter(a); iter; iter = json_object_iter_next(a, iter))
+        {
+            key = json_object_iter_key(iter);
+            json_array_append_new(path, json_string(key));
+            if (json_object_get(b, key))
+                {diff_walk(json_object_iter_value(iter), json_object_get(b, key), path);}
+            else
+                {print_path('-', path);}
+            json_array_remove(path, json_array_size(path) - 1);
+        }
+        for (iter = json_object_iter(b); iter; iter = json_object_iter_next(b, iter))
+        {
+            key = json_object_iter_key(iter);
+            if (json_object_get(a, key))
+                {continue;}
+            json_array_append_new(path, json_string(key));
+            print_path('+', path);
+            json_array_remove(path, json_array_size(path) - 1);
+        }
+        return;
+    }
+    na = json_array_size(a);
+    nb = json_array_size(b);
+    for (i = 0; i < MAX(na, nb); i++)
+    {
+        json_array_append_new(path, json_integer(i));
+        if (i >= nb)
+            {print_path('-', path);}
+        else if (i >= na)
+            {print_path('+', path);}
+        else
+            {diff_walk(json_array_get(a, i), json_array_get(b, i), path);}
+        json_array_remove(path, json_array_size(path) - 1);
+    }
+}
+
+void diff(json_t* json, char* path)
+// shoddy, prints directly
+{
+    char* content;
+    size_t len;
+    json_t* other;
+    json_t* trail;
+    json_error_t error;
+
+    content = read_file(path, &len);
+    if (!content)
+        {err("error: failed to read diff input"); return;}
+    other = compat_json_loads(content, &error);
+    free_input(content);
+    if (!other)
+    {
+        if (!quiet)
+            {fprintf(errout, "json read error in %s: line %0d: %s\n", path, error.line, error.text);}
+        err("error: failed to parse diff input");
+        return;
+    }
+    hash_all(json);
+    hash_all(other);
+    trail = json_array();
+    diff_walk(json, other, trail);
+    json_decref(trail);
+    json_decref(other);
+    // its nodes are gone, their addresses may come back
+    memo_reset();
+}
+
+// parallel parsing of one large document
+// the top level array or object is cut into its elements and each
+// thread parses a share of them, balanced by bytes, with jansson.  an
+// element too big for one share that is a container itself, like the
+// array in {"data": [...]}, is cut up the same way in turn.  finding the cuts needs
+// the string state at every chunk start, so each chunk is first scanned
+// twice, as if it began outside and inside a string.  chaining those
+// results from the front gives the true state of every chunk.  anything
+// unexpected gives up, and the caller parses sequentially so errors
+// are still reported with an exact line and column.  that includes
+// nesting past jansson's limit, which the pieces would not see.
+
+#define PARSEMIN (1 << 24)
+#define PARSELEVELS 8  // how deep a big element is followed
+#ifndef JSON_PARSER_MAX_DEPTH
+#define JSON_PARSER_MAX_DEPTH 2048  // as in jansson's load.c
+#endif
+
+typedef struct
+{
+    const char* start;
+    const char* end;
+    int     end_in[2];  // pass 1, for a start outside and inside a string
+    long    delta[2];
+    long    low[2];
+    int     in;         // pass 2, the true state at start
+    long    depth;
+    long    high;       // deepest nesting seen in pass 2
+    size_t* seps;       // offsets of ',' and ':' between top level elements
+    size_t  nseps;
+    size_t  cap;
+    int     fail;
+} scan_job;
+
+const char* scan_base;
+
+int scan_chunk(scan_job* job, int in, long* depth, long* low, long* high, int record)
+// returns the string state at the end of the chunk
+{
+    const char* p;
+    int esc = 0;
+    size_t* bigger;
+    for (p = job->start; p < job->end; p++)
+    {
+        if (in)
+        {
+            if (esc)
+                {esc = 0;}
+            else if (*p == '\\')
+                {esc = 1;}
+            else if (*p == '"')
+                {in = 0;}
+            continue;
+        }
+        switch (*p)
+        {
+            case '"':
+                in = 1;
+                break;
+            case '{':
+            case '[':
+                if (++*depth > *high)
+                    {*high = *depth;}
+                break;
+            case '}':
+            case ']':
+                if (--*depth < *low)
+                    {*low = *depth;}
+                break;
+            case ',':
+            case ':':
+                if (!record || *depth != 0)
+                    {break;}
+                if (job->nseps == job->cap)
+                {
+                    job->cap = job->cap ? job->cap * 2 : 1024;
+                    bigger = realloc(job->seps, job->cap * sizeof(size_t));
+                    if (!bigger)
+                        {job->fail = 1; return in;}
+                    job->seps = bigger;
+                }
+                job->seps[job->nseps++] = p - scan_base;
+                break;
+            default:
+                break;
+        }
+    }
+    return in;
+}
+
+void* scan_worker(void* arg)
+// pass 1 while the start state is unknown, pass 2 once it is
+{
+    scan_job* job = arg;
+    long depth, low, high;
+    int in;
+    if (job->in >= 0)
+    {
+        depth = low = job->high = job->depth;
+        scan_chunk(job, job->in, &depth, &low, &job->high, 1);
+        return NULL;
+    }
+    for (in = 0; in < 2; in++)
+    {
+        depth = low = high = 0;
+        job->end_in[in] = scan_chunk(job, in, &depth, &low, &high, 0);
+        job->delta[in] = depth;
+        job->low[in] = low;
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    const char* base;
+    size_t* cuts;    // element i spans cuts[i]+1 .. cuts[i+1]
+    size_t  first;
+    size_t  last;
+    int     object;  // odd cuts are ':' between key and value
+    json_t** values;
+    json_t** keys;
+    const char* big; // values left for parallel_range()
+    int     fail;
+} parse_job;
+
+void* parse_worker(void* arg)
+{
+    parse_job* job = arg;
+    json_error_t error;
+    size_t i, c;
+    for (i = job->first; i < job->last && !job->fail; i++)
+    {
+        c = job->object ? i * 2 : i;
+        if (job->object)
+        {
+            job->keys[i] = json_loadb(job->base + job->cuts[c] + 1,
+                                      job->cuts[c + 1] - job->cuts[c] - 1, JSON_DECODE_ANY, &error);
+            if (!json_is_string(job->keys[i]))
+                {job->fail = 1; break;}
+            c++;
+        }
+        if (job->big[i])
+            {continue;}
+        job->values[i] = json_loadb(job->base + job->cuts[c] + 1,
+                                    job->cuts[c + 1] - job->cuts[c] - 1, JSON_DECODE_ANY, &error);
+        if (!job->values[i])
+            {job->fail = 1;}
+    }
+    return NULL;
+}
+
+#if JANSSON_VERSION_HEX >= 0x020300
+json_t* parallel_range(const char* content, const char* body, const char* end, int level)
+// body to end is one array or object, brackets included.  elements
+// bigger than a fair share are containers worth cutting up themselves,
+// they are parsed the same way with all threads, one after the other
+{
+    scan_job scans[MAXTHREADS];
+    parse_job parses[MAXTHREADS];
+    const char* p;
+    const char* q;
+    size_t* cuts = NULL;
+    json_t** values = NULL;
+    json_t** keys = NULL;
+    char* big = NULL;
+    json_t* root = NULL;
+    json_error_t error;
+    size_t i, n, ncuts, step, stride, share, total, done;
+    int t, in, object, fail = 0;
+    long depth;
+
+    object = *body == '{';
+    body++;
+    end--;
+
+    // chunk starts never follow a backslash, so they are never mid escape
+    memset(scans, 0, sizeof(scans));
+    step = (end - body) / threads;
+    scan_base = content;
+    for (t = 0; t < threads; t++)
+    {
+        scans[t].start = t ? scans[t - 1].end : body;
+        scans[t].end = t == threads - 1 ? end : body + step * (t + 1);
+        while (scans[t].end < end && scans[t].end[-1] == '\\')
+            {scans[t].end++;}
+        if (scans[t].end < scans[t].start)
+            {scans[t].end = scans[t].start;}
+        scans[t].in = -1;
+    }
+    run_parallel(scan_worker, scans, sizeof(scan_job), threads);
+
+    // chain the speculative results, the top level must never close early
+    in = 0;
+    depth = 0;
+    for (t = 0; t < threads; t++)
+    {
+        if (depth + scans[t].low[in] < 0)
+            {return NULL;}
+        scans[t].in = in;
+        scans[t].depth = depth;
+        depth += scans[t].delta[in];
+        in = scans[t].end_in[in];
+    }
+    if (in || depth)
+        {return NULL;}
+    run_parallel(scan_worker, scans, sizeof(scan_job), threads);
+
+    // this container is level + 1 deep, the big ones are direct children
+    ncuts = 2;
+    for (t = 0; t < threads; t++)
+    {
+        ncuts += scans[t].nseps;
+        fail |= scans[t].fail;
+        fail |= level + 1 + scans[t].high > JSON_PARSER_MAX_DEPTH;
+    }
+    if (!fail)
+        {cuts = malloc(ncuts * sizeof(size_t));}
+    if (cuts)
+    {
+        cuts[0] = body - content - 1;
+        for (ncuts = 1, t = 0; t < threads; t++)
+        {
+            memcpy(cuts + ncuts, scans[t].seps, scans[t].nseps * sizeof(size_t));
+            ncuts += scans[t].nseps;
+        }
+        cuts[ncuts++] = end - content;
+    }
+    for (t = 0; t < threads; t++)
+        {free(scans[t].seps);}
+    if (!cuts)
+        {return NULL;}
+
+    // objects alternate key ':' value ',', arrays only have ','
+    for (i = 1; i < ncuts - 1; i++)
+    {
+        if (content[cuts[i]] != ((object && i % 2) ? ':' : ','))
+            {free(cuts); return NULL;}
+    }
+    // k members have 2k - 1 separators, so 2k + 1 cuts
+    if (object && !(ncuts % 2))
+        {free(cuts); return NULL;}
+    stride = object ? 2 : 1;
+    n = (ncuts - 1) / stride;
+
+    values = calloc(n, sizeof(json_t*));
+    keys = calloc(n, sizeof(json_t*));
+    big = calloc(n + 1, 1);
+    // also settles jansson's hash seed before the threads start
+    root = object ? json_object() : json_array();
+    if (!values || !keys || !big || !root)
+        {hard_err("internal error: out of memory");}
+
+    // a single {"data": [...]} member would keep one thread busy alone
+    share = MAX(PARSEMIN, (size_t)(end - body) / threads);
+    total = 0;
+    for (i = 0; i < n; i++)
+    {
+        p = content + cuts[i * stride + stride - 1] + 1;
+        q = content + cuts[i * stride + stride];
+        if (level < PARSELEVELS && (size_t)(q - p) >= share)
+        {
+            while (p < q && JSON_WHITE(*p))
+                {p++;}
+            while (q > p && JSON_WHITE(q[-1]))
+                {q--;}
+            big[i] = q - p >= 2 && ((*p == '{' && q[-1] == '}') || (*p == '[' && q[-1] == ']'));
+        }
+        if (!big[i])
+            {total += cuts[i * stride + stride] - cuts[i * stride];}
+    }
+
+    // shares by bytes, a few large elements should not leave threads idle
+    done = 0;
+    t = 0;
+    parses[0].first = 0;
+    for (i = 0; i < n; i++)
+    {
+        while (t < threads - 1 && done >= total / threads * (t + 1))
+        {
+            parses[t].last = i;
+            parses[++t].first = i;
+        }
+        if (!big[i])
+            {done += cuts[i * stride + stride] - cuts[i * stride];}
+    }
+    parses[t].last = n;
+    while (++t < threads)
+        {parses[t].first = parses[t].last = n;}
+    for (t = 0; t < threads; t++)
+    {
+        parses[t].base = content;
+        parses[t].cuts = cuts;
+        parses[t].object = object;
+        parses[t].values = values;
+        parses[t].keys = keys;
+        parses[t].big = big;
+        parses[t].fail = 0;
+    }
+    run_parallel(parse_worker, parses, sizeof(parse_job), threads);
+    for (t = 0; t < threads; t++)
+        {fail |= parses[t].fail;}
+
+    for (i = 0; i < n && !fail; i++)
+    {
+        if (!big[i])
+            {continue;}
+        p = content + cuts[i * stride + stride - 1] + 1;
+        q = content + cuts[i * stride + stride];
+        while (JSON_WHITE(*p))
+            {p++;}
+        while (JSON_WHITE(q[-1]))
+            {q--;}
+        values[i] = parallel_range(content, p, q, level + 1);
+        if (!values[i])
+            {values[i] = json_loadb(p, q - p, 0, &error);}
+        fail = !values[i];
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (fail)
+        {
+            json_decref(keys[i]);
+            json_decref(values[i]);
+        }
+        else if (object)
+        {
+            json_object_set_new(root, json_string_value(keys[i]), values[i]);
+            json_decref(keys[i]);
+        }
+        else
+            {json_array_append_new(root, values[i]);}
+    }
+    free(cuts);
+    free(values);
+    free(keys);
+    free(big);
+    if (fail)
+        {json_decref(root); return NULL;}
+    return root;
+}
+#endif
+
+json_t* parallel_loads(const char* content, size_t len)
+// returns NULL whenever the sequential parser should be used instead
+{
+#if JANSSON_VERSION_HEX < 0x020300
+    (void)content;
+    (void)len;
+    return NULL;
+#else
+    const char* body;
+    const char* end;
+
+    if (threads < 2 || len < PARSEMIN)
+        {return NULL;}
+    body = content;
+    end = content + len;
+    while (body < end && JSON_WHITE(*body))
+        {body++;}
+    while (end > body && JSON_WHITE(end[-1]))
+        {end--;}
+    if (end - body < 2)
+        {return NULL;}
+    if (!((*body == '{' && end[-1] == '}') || (*body == '[' && end[-1] == ']')))
+        {return NULL;}
+    return parallel_range(content, body, end, 0);
+#endif
+}
+
+// delimited rows (-c, -v)
+// one line per element with the fields named by comma separated paths,
+// path components are separated by dots.  the parsed paths are cached
+// by argument since -a runs the same argument once per element.  -G
+// parses only the part of its argument before the '='.
+
+#define COLCACHE 8
+
+typedef struct
+{
+    const char* arg;
+    size_t len;
+    char*  buf;    // copy of arg cut up into components
+    char** parts;  // components, each column ends with NULL
+    int    ncols;
+} columns;
+
+columns colcache[COLCACHE];
+int colcache_count = 0;
+char* placeholder = "";
+
+columns* parse_columns(char* arg, size_t len)
+{
+    columns* cols;
+    char* p;
+    size_t n = 2;
+    int i;
+
+    for (i = 0; i < colcache_count; i++)
+    {
+        if (colcache[i].arg == arg && colcache[i].len == len)
+            {return &colcache[i];}
+    }
+    if (colcache_count == COLCACHE)
+    {
+        free(colcache[0].buf);
+        free(colcache[0].parts);
+        memmove(colcache, colcache + 1, sizeof(columns) * (COLCACHE - 1));
+        colcache_count--;
+    }
+    cols = &colcache[colcache_count++];
+    for (p = arg; p < arg + len; p++)
+        {n += (*p == ',' || *p == '.') ? 2 : 0;}
+    cols->arg = arg;
+    cols->len = len;
+    cols->buf = strndup(arg, len);
+    cols->parts = malloc(n * sizeof(char*));
+    if (!cols->buf || !cols->parts)
+        {hard_err("internal error: out of memory");}
+    cols->ncols = 1;
+    n = 0;
+    cols->parts[n++] = cols->buf;
+    for (p = cols->buf; *p; p++)
+    {
+        if (*p == '.')
+        {
+            *p = '\0';
+            cols->parts[n++] = p + 1;
+        }
+        else if (*p == ',')
+        {
+            *p = '\0';
+            cols->parts[n++] = NULL;
+            cols->parts[n++] = p + 1;
+            cols->ncols++;
+        }
+    }
+    cols->parts[n] = NULL;
+    return cols;
+}
+
+json_t* walk_path(json_t* json, char** parts)
+// like a chain of -e, but returns NULL instead of failing
+{
+    char* endptr;
+    long i, s;
+    for (; *parts && json; parts++)
+    {
+        switch (json_typeof(json))
+        {
+            case JSON_OBJECT:
+                json = json_object_get(json, *parts);
+                break;
+            case JSON_ARRAY:
+                s = json_array_size(json);
+                i = strtol(*parts, &endptr, 10);
+                if (**parts == '\0' || *endptr != '\0' || i < -s || i >= s)
+                    {return NULL;}
+                json = json_array_get(json, i < 0 ? i + s : i);
+                break;
+            default:
+                return NULL;
+        }
+    }
+    return json;
+}
+
+void write_field(const char* s, char sep)
+// tsv escapes with backslashes, csv quotes the field when it has to
+{
+    const char* run = s;
+    const char* esc;
+    if (sep == ',')
+    {
+        if (!strpbrk(s, ",\"\r\n"))
+            {fputs(s, out); return;}
+        fputc('"', out);
+        for (; *s; s++)
+        {
+            if (*s != '"')
+                {continue;}
+            fwrite(run, 1, s - run + 1, out);
+            run = s;
+        }
+        fputs(run, out);
+        fputc('"', out);
+        return;
+    }
+    for (; *s; s++)
+    {
+        switch (*s)
+        {
+            case '\t': esc = "\\t"; break;
+            case '\n': esc = "\\n"; break;
+            case '\r': esc = "\\r"; break;
+            case '\\': esc = "\\\\"; break;
+            default: continue;
+        }
+        fwrite(run, 1, s - run, out);
+        fputs(esc, out);
+        run = s + 1;
+    }
+    fputs(run, out);
+}
+
+void row(json_t* json, char* arg, char sep)
+// shoddy, prints directly
+{
+    columns* cols = parse_columns(arg, strlen(arg));
+    char** parts = cols->parts;
+    json_t* value;
+    char* temp;
+    int i;
+
+    for (i = 0; i < cols->ncols; i++)
+    {
+        if (i)
+            {fputc(sep, out);}
+        value = walk_path(json, parts);
+        while (*parts++)
+            {;}
+        if (value == NULL || json_is_null(value))
+            {write_field(placeholder, sep); continue;}
+        switch (json_typeof(value))
+        {
+            case JSON_STRING:
+                write_field(json_string_value(value), sep);
+                break;
+            case JSON_OBJECT:
+            case JSON_ARRAY:
+                temp = smart_dumps(value, dumps_compact);
+                write_field(temp, sep);
+                free(temp);
+                break;
+            case JSON_INTEGER:
+                fprintf(out, "%" JSON_INTEGER_FORMAT, json_integer_value(value));
+                break;
+            case JSON_TRUE:
+                fputs("true", out);
+                break;
+            case JSON_FALSE:
+                fputs("false", out);
+                break;
+            default:
+                smart_dumpf(value, dumps_compact, out);
+                break;
+        }
+    }
+    fputc('\n', out);
+}
+
+// schema inference (-y)
+// one walk over the tree, one record per path with array positions
+// collapsed to [].  paths are keyed by (parent path, key) so the path
+// text is only built for new ones.  the number of paths and samples is
+// capped so a document with millions of distinct keys stays bounded.
+
+#define SCHEMAPATHS   4096
+#define SCHEMASLOTS   (SCHEMAPATHS * 2)
+#define SCHEMASAMPLES 3
+#define SAMPLECHARS   64
+#define LENBUCKETS    32   // log2 of array lengths
+
+typedef struct
+{
+    int        parent;    // -1 for the root
+    char*      key;       // NULL for array items and the root
+    char*      path;
+    size_t     count;
+    size_t     types[6];  // in pretty_type() order
+    size_t     str_min, str_max;
+    size_t     ints, reals;
+    json_int_t int_min, int_max;
+    double     real_min, real_max;
+    size_t     len_min, len_max;
+    size_t     lengths[LENBUCKETS];
+    json_t*    samples;
+} schema_path;
+
+const char* schema_types[6] = {"object", "array", "string", "number", "bool", "null"};
+
+schema_path* schema_paths = NULL;
+int schema_count = 0;
+int schema_slots[SCHEMASLOTS];  // index + 1, 0 is empty
+size_t schema_dropped = 0;
+
+int type_slot(json_t* json)
+{
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+            return 0;
+        case JSON_ARRAY:
+            return 1;
+        case JSON_STRING:
+            return 2;
+        case JSON_INTEGER:
+        case JSON_REAL:
+            return 3;
+        case JSON_TRUE:
+        case JSON_FALSE:
+            return 4;
+        default:
+            return 5;
+    }
+}
+
+int identifier(const char* s)
+{
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        {return 0;}
+    for (s++; *s; s++)
+    {
+        if (!isalnum((unsigned char)*s) && *s != '_')
+            {return 0;}
+    }
+    return 1;
+}
+
+char* child_path(const char* parent, const char* key)
+// .name, ["odd key"] or [] appended to the parent's path
+{
+    char* path;
+    char* quoted;
+    json_t* temp;
+    int i;
+    if (parent == NULL)
+        {return strdup(".");}
+    // .name rather than ..name, but .[] and .["odd key"] below the root
+    if (key && identifier(key) && !strcmp(parent, "."))
+        {parent = "";}
+    if (key == NULL)
+        {i = asprintf(&path, "%s[]", parent);}
+    else if (identifier(key))
+        {i = asprintf(&path, "%s.%s", parent, key);}
+    else
+    {
+        temp = json_string(key);
+        quoted = smart_dumps(temp, dumps_compact);
+        i = asprintf(&path, "%s[%s]", parent, quoted);
+        free(quoted);
+        json_decref(temp);
+    }
+    if (i == -1)
+        {hard_err("internal error: out of memory");}
+    return path;
+}
+
+int schema_find(int parent, const char* key)
+// index of the path, created on first sight, -1 once the cap is reached
+{
+    uint64_t h = mix64((uint64_t)(parent + 2) * 0x9e3779b97f4a7c15ULL ^ (key ? hash_bytes(key, strlen(key)) : 0));
+    size_t slot = h & (SCHEMASLOTS - 1);
+    schema_path* p;
+    int i;
+    while ((i = schema_slots[slot]))
+    {
+        p = &schema_paths[i - 1];
+        if (p->parent == parent && (p->key == key || (p->key && key && !strcmp(p->key, key))))
+            {return i - 1;}
+        slot = (slot + 1) & (SCHEMASLOTS - 1);
+    }
+    if (schema_count == SCHEMAPATHS)
+        {return -1;}
+    p = &schema_paths[schema_count];
+    memset(p, 0, sizeof(schema_path));
+    p->parent = parent;
+    p->key = key ? strdup(key) : NULL;
+    p->path = child_path(parent < 0 ? NULL : schema_paths[parent].path, key);
+    p->str_min = p->len_min = SIZE_MAX;
+    p->samples = json_array();
+    schema_slots[slot] = ++schema_count;
+    return schema_count - 1;
+}
+
+json_t* sample(json_t* json)
+// long strings are cut at a character boundary
+{
+    const char* s = json_string_value(json);
+    size_t n = SAMPLECHARS;
+    char* temp;
+    json_t* cut;
+    if (!json_is_string(json) || strlen(s) <= n)
+        {return json_incref(json);}
+    while (n && ((unsigned char)s[n] & 0xc0) == 0x80)
+        {n--;}
+    temp = strndup(s, n);
+    cut = json_string(temp);
+    free(temp);
+    return cut;
+}
+
+void schema_add_sample(schema_path* p, json_t* json)
+{
+    json_t* s;
+    size_t i;
+    if (json_array_size(p->samples) >= SCHEMASAMPLES)
+        {return;}
+    s = sample(json);
+    for (i = 0; i < json_array_size(p->samples); i++)
+    {
+        if (json_equal(json_array_get(p->samples, i), s))
+        {
+            json_decref(s);
+            return;
+        }
+    }
+    json_array_append_new(p->samples, s);
+}
+
+size_t schema_values(json_t* json)
+// the value and everything below it, for the dropped count
+{
+    void* iter;
+    size_t i, n = 1;
+    if (json_is_object(json))
+    {
+        for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+            {n += schema_values(json_object_iter_value(iter));}
+    }
+    for (i = 0; i < json_array_size(json); i++)
+        {n += schema_values(json_array_get(json, i));}
+    return n;
+}
+
+void schema_walk(json_t* json, int parent, const char* key)
+{
+    int i = schema_find(parent, key);
+    schema_path* p;
+    const char* k;
+    void* iter;
+    size_t n, b;
+    double d;
+    json_int_t v;
+
+    if (i < 0)
+    {
+        schema_dropped += schema_values(json);
+        return;
+    }
+    p = &schema_paths[i];
+    p->count++;
+    p->types[type_slot(json)]++;
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+            for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+            {
+                k = json_object_iter_key(iter);
+                schema_walk(json_object_iter_value(iter), i, k);
+            }
+            return;
+        case JSON_ARRAY:
+            n = json_array_size(json);
+            p->len_min = MIN(p->len_min, n);
+            p->len_max = MAX(p->len_max, n);
+            for (b = 0; b < LENBUCKETS - 1 && n >> b; b++)
+                {;}
+            p->lengths[b]++;
+            for (b = 0; b < n; b++)
+                {schema_walk(json_array_get(json, b), i, NULL);}
+            return;
+        case JSON_STRING:
+            n = strlen(json_string_value(json));
+            p->str_min = MIN(p->str_min, n);
+            p->str_max = MAX(p->str_max, n);
+            break;
+        case JSON_INTEGER:
+            v = json_integer_value(json);
+            if (++p->ints == 1 || v < p->int_min)
+                {p->int_min = v;}
+            if (p->ints == 1 || v > p->int_max)
+                {p->int_max = v;}
+            break;
+        case JSON_REAL:
+            d = json_real_value(json);
+            if (++p->reals == 1 || d < p->real_min)
+                {p->real_min = d;}
+            if (p->reals == 1 || d > p->real_max)
+                {p->real_max = d;}
+            break;
+        default:
+            break;
+    }
+    schema_add_sample(p, json);
+}
+
+json_t* range_json(size_t lo, size_t hi)
+{
+    json_t* r = json_object();
+    json_object_set_new(r, "min", json_integer(lo));
+    json_object_set_new(r, "max", json_integer(hi));
+    return r;
+}
+
+json_t* schema_entry(schema_path* p)
+{
+    json_t* entry = json_object();
+    json_t* types = json_object();
+    json_t* r;
+    json_t* hist;
+    char label[48];
+    size_t b;
+    int i;
+
+    json_object_set_new(entry, "count", json_integer(p->count));
+    for (i = 0; i < 6; i++)
+    {
+        if (p->types[i])
+            {json_object_set_new(types, schema_types[i], json_integer(p->types[i]));}
+    }
+    json_object_set_new(entry, "types", types);
+    if (p->key && p->parent >= 0 && schema_paths[p->parent].types[0])
+        {json_object_set_new(entry, "presence", json_real((double)p->count / schema_paths[p->parent].types[0]));}
+    if (p->types[2])
+        {json_object_set_new(entry, "string_length", range_json(p->str_min, p->str_max));}
+    if (p->types[3])
+    {
+        r = json_object();
+        if (!p->ints)
+        {
+            json_object_set_new(r, "min", json_real(p->real_min));
+            json_object_set_new(r, "max", json_real(p->real_max));
+        }
+        else if (!p->reals)
+        {
+            json_object_set_new(r, "min", json_integer(p->int_min));
+            json_object_set_new(r, "max", json_integer(p->int_max));
+        }
+        else
+        {
+            json_object_set_new(r, "min", json_real(MIN((double)p->int_min, p->real_min)));
+            json_object_set_new(r, "max", json_real(MAX((double)p->int_max, p->real_max)));
+        }
+        json_object_set_new(entry, "number_range", r);
+    }
+    if (p->types[1])
+    {
+        r = range_json(p->len_min, p->len_max);
+        hist = json_object();
+        for (b = 0; b < LENBUCKETS; b++)
+        {
+            if (!p->lengths[b])
+                {continue;}
+            if (b < 2)
+                {snprintf(label, sizeof(label), "%zu", b);}
+            else
+                {snprintf(label, sizeof(label), "%zu-%zu", (size_t)1 << (b - 1), ((size_t)1 << b) - 1);}
+            json_object_set_new(hist, label, json_integer(p->lengths[b]));
+        }
+        json_object_set_new(r, "histogram", hist);
+        json_object_set_new(entry, "array_length", r);
+    }
+    if (json_array_size(p->samples))
+        {json_object_set(entry, "samples", p->samples);}
+    return entry;
+}
+
+json_t* schema(json_t* json)
+{
+    json_t* summary = json_object();
+    int i;
+    if (!schema_paths && !(schema_paths = malloc(SCHEMAPATHS * sizeof(schema_path))))
+        {hard_err("internal error: out of memory");}
+    memset(schema_slots, 0, sizeof(schema_slots));
+    schema_count = 0;
+    schema_dropped = 0;
+    schema_walk(json, -1, NULL);
+    for (i = 0; i < schema_count; i++)
+    {
+        json_object_set_new(summary, schema_paths[i].path, schema_entry(&schema_paths[i]));
+        free(schema_paths[i].key);
+        free(schema_paths[i].path);
+        json_decref(schema_paths[i].samples);
+    }
+    if (schema_dropped && !quiet)
+    {
+        fprintf(errout, "warning: more than %i paths, %zu values were not summarized\n",
+                SCHEMAPATHS, schema_dropped);
+    }
+    return summary;
+}
+
+// aggregates (-g)
+// folds the values of a -a iteration into one result.  when -g comes
+// right after -a the whole container is reduced in one go, split over
+// -T threads, and the partial results are merged.  otherwise every
+// pass through the iteration adds one value.
+
+#define HLLBITS  14
+#define HLLSIZE  (1 << HLLBITS)
+#define AGGMIN   4096   // values per thread worth starting one for
+
+typedef struct
+{
+    size_t         count;  // values seen, nulls and missing fields excluded
+    size_t         ints, reals;
+    json_int_t     isum;
+    double         rsum;
+    int            overflow;
+    json_int_t     imin, imax;
+    double         rmin, rmax;
+    json_t*        bad;    // first value that is not a number
+    unsigned char* hll;    // distinct only
+} aggregate;
+
+aggregate aggs[STACKDEPTH];  // one per -a level
+
+char aggregate_op(char* arg, char*** parts)
+// "op" or "op:path", the path as for -c
+{
+    static const char* names[] = {"count", "sum", "min", "max", "mean", "distinct"};
+    static const char codes[] = "csnxmd";
+    char* colon = strchr(arg, ':');
+    size_t n = colon ? (size_t)(colon - arg) : strlen(arg);
+    int i;
+    *parts = colon && colon[1] ? parse_columns(colon + 1, strlen(colon + 1))->parts : NULL;
+    for (i = 0; i < 6; i++)
+    {
+        if (strlen(names[i]) == n && !strncmp(arg, names[i], n))
+            {return codes[i];}
+    }
+    arg_err("parse error: unknown aggregate on arg %i, \"%s\"");
+    return 'c';
+}
+
+void aggregate_reset(aggregate* agg, char op)
+{
+    memset(agg, 0, sizeof(aggregate));
+    if (op != 'd')
+        {return;}
+    agg->hll = calloc(HLLSIZE, 1);
+    if (!agg->hll)
+        {hard_err("internal error: out of memory");}
+}
+
+void hll_add(unsigned char* hll, uint64_t h)
+{
+    size_t i = h >> (64 - HLLBITS);
+    uint64_t w = (h << HLLBITS) | ((uint64_t)1 << (HLLBITS - 1));
+    unsigned char rank = __builtin_clzll(w) + 1;
+    if (rank > hll[i])
+        {hll[i] = rank;}
+}
+
+json_int_t hll_estimate(unsigned char* hll)
+{
+    double m = HLLSIZE;
+    double sum = 0;
+    double e;
+    size_t i, zeros = 0;
+    for (i = 0; i < HLLSIZE; i++)
+    {
+        sum += 1.0 / ((uint64_t)1 << hll[i]);
+        zeros += !hll[i];
+    }
+    e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // small ranges are better served by linear counting
+    if (e <= 2.5 * m && zeros)
+        {e = m * log(m / zeros);}
+    return (json_int_t)(e + 0.5);
+}
+
+void aggregate_fold(aggregate* agg, char op, json_t* json, hash_memo* memo)
+// never reports errors itself, it may run on a worker thread
+{
+    json_int_t v;
+    double d;
+    if (json == NULL || json_is_null(json))
+        {return;}
+    agg->count++;
+    if (op == 'c')
+        {return;}
+    if (op == 'd')
+    {
+        hll_add(agg->hll, tree_hash(json, memo, 1));
+        return;
+    }
+    if (json_is_integer(json))
+    {
+        v = json_integer_value(json);
+        if (__builtin_add_overflow(agg->isum, v, &agg->isum))
+            {agg->overflow = 1;}
+        if (!agg->ints++ || v < agg->imin)
+            {agg->imin = v;}
+        if (agg->ints == 1 || v > agg->imax)
+            {agg->imax = v;}
+    }
+    else if (json_is_real(json))
+    {
+        d = json_real_value(json);
+        agg->rsum += d;
+        if (!agg->reals++ || d < agg->rmin)
+            {agg->rmin = d;}
+        if (agg->reals == 1 || d > agg->rmax)
+            {agg->rmax = d;}
+    }
+    else
+    {
+        agg->count--;
+        if (!agg->bad)
+            {agg->bad = json;}
+    }
+}
+
+void aggregate_merge(aggregate* a, aggregate* b)
+{
+    size_t i;
+    a->count += b->count;
+    if (__builtin_add_overflow(a->isum, b->isum, &a->isum))
+        {a->overflow = 1;}
+    a->overflow |= b->overflow;
+    a->rsum += b->rsum;
+    if (b->ints && (!a->ints || b->imin < a->imin))
+        {a->imin = b->imin;}
+    if (b->ints && (!a->ints || b->imax > a->imax))
+        {a->imax = b->imax;}
+    if (b->reals && (!a->reals || b->rmin < a->rmin))
+        {a->rmin = b->rmin;}
+    if (b->reals && (!a->reals || b->rmax > a->rmax))
+        {a->rmax = b->rmax;}
+    a->ints += b->ints;
+    a->reals += b->reals;
+    if (!a->bad)
+        {a->bad = b->bad;}
+    for (i = 0; a->hll && i < HLLSIZE; i++)
+        {a->hll[i] = MAX(a->hll[i], b->hll[i]);}
+}
+
+json_t* aggregate_result(aggregate* agg, char op)
+// frees the registers, reports problems on the main thread
+{
+    json_t* result;
+    if (agg->bad)
+        {json_err("is not a number", agg->bad);}
+    if (agg->overflow)
+        {err("error: integer overflow in sum");}
+    switch (op)
+    {
+        case 'c':
+            return json_integer(agg->count);
+        case 'd':
+            result = json_integer(hll_estimate(agg->hll));
+            free(agg->hll);
+            agg->hll = NULL;
+            return result;
+        case 's':
+            if (agg->reals)
+                {return json_real(agg->isum + agg->rsum);}
+            return json_integer(agg->isum);
+        case 'm':
+            if (!agg->count)
+                {return json_null();}
+            return json_real((agg->isum + agg->rsum) / agg->count);
+        case 'n':
+            if (agg->ints && (!agg->reals || agg->imin <= agg->rmin))
+                {return json_integer(agg->imin);}
+            return agg->reals ? json_real(agg->rmin) : json_null();
+        case 'x':
+        default:
+            if (agg->ints && (!agg->reals || agg->imax >= agg->rmax))
+                {return json_integer(agg->imax);}
+            return agg->reals ? json_real(agg->rmax) : json_null();
+    }
+}
+
+typedef struct
+{
+    json_t*   container;
+    json_t**  values;  // object members, arrays are read directly
+    size_t    from, to;
+    char      op;
+    char**    parts;
+    aggregate agg;
+} aggregate_job;
+
+void* aggregate_worker(void* arg)
+{
+    aggregate_job* job = arg;
+    hash_memo memo;
+    json_t* json;
+    size_t i;
+    memset(&memo, 0, sizeof(memo));
+    for (i = job->from; i < job->to; i++)
+    {
+        json = job->values ? job->values[i] : json_array_get(job->container, i);
+        if (job->parts)
+            {json = walk_path(json, job->parts);}
+        aggregate_fold(&job->agg, job->op, json, &memo);
+    }
+    free(memo.key);
+    free(memo.val);
+    return NULL;
+}
+
+json_t* aggregate_all(json_t* container, char op, char** parts)
+{
+    aggregate_job jobs[MAXTHREADS];
+    json_t** values = NULL;
+    void* iter;
+    size_t n, i;
+    int t, nt;
+
+    if (json_is_object(container))
+    {
+        n = json_object_size(container);
+        values = malloc((n + 1) * sizeof(json_t*));
+        if (!values)
+            {hard_err("internal error: out of memory");}
+        i = 0;
+        for (iter = json_object_iter(container); iter; iter = json_object_iter_next(container, iter))
+            {values[i++] = json_object_iter_value(iter);}
+    }
+    else if (json_is_array(container))
+        {n = json_array_size(container);}
+    else
+    {
+        json_err("is not mappable", container);
+        return json_null();
+    }
+    nt = MAX(1, MIN((size_t)threads, n / AGGMIN));
+    for (t = 0; t < nt; t++)
+    {
+        jobs[t].container = container;
+        jobs[t].values = values;
+        jobs[t].from = n * t / nt;
+        jobs[t].to = n * (t + 1) / nt;
+        jobs[t].op = op;
+        jobs[t].parts = parts;
+        aggregate_reset(&jobs[t].agg, op);
+    }
+    run_parallel(aggregate_worker, jobs, sizeof(aggregate_job), nt);
+    for (t = 1; t < nt; t++)
+    {
+        aggregate_merge(&jobs[0].agg, &jobs[t].agg);
+        free(jobs[t].agg.hll);
+    }
+    free(values);
+    return aggregate_result(&jobs[0].agg, op);
+}
+
+#define ALL_OPTIONS "PSQVCIMLf0tlkupajHyF:T:R:z:O:A:m:K:N:E:e:s:n:d:i:x:D:c:v:g:o:G:U:"
+
+int aggregate_ahead(int argc, char* argv[], int i, int* between)
+// argv index of the -g ending this -a level, 0 if there is none.
+// between counts the options before it
+{
+    char* p;
+    char* spec;
+    *between = 0;
+    for (; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+            {continue;}
+        for (p = argv[i] + 1; *p; p++)
+        {
+            if (*p == 'a')
+                {return 0;}
+            if (*p == 'g')
+                {return p == argv[i] + 1 ? i : 0;}
+            (*between)++;
+            spec = strchr(ALL_OPTIONS, *p);
+            if (spec && spec[1] == ':')
+            {
+                // the rest is its argument, or the next word is
+                if (!p[1])
+                    {i++;}
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+int aggregate_action(char* arg, int argc, char* argv[])
+// returns 1 while the -a iteration still has values to add
+{
+    char op;
+    char** parts;
+    mapping* m;
+    aggregate* agg;
+    json_t* json;
+    json_t* result;
+    json_t* container;
+    hash_memo memo;
+    size_t size;
+    int resume;
+    int mine;
+    int between;
+
+    op = aggregate_op(arg, &parts);
+    if (MAPEMPTY)
+    {
+        // no -a, reduce the elements of the top value
+        json = POP;
+        mine = POPPED;
+        result = aggregate_all(json, op, parts);
+        if (mine)
+            {release(json);}
+        PUSH(result);
+        return 0;
+    }
+    m = map_safe_peek();
+    agg = &aggs[m - mapstack];
+    resume = optind;
+    container = m->json;
+    size = json_is_object(container) ? json_object_size(container) : json_array_size(container);
+    if (!m->agg && (!size || (aggregate_ahead(argc, argv, m->opt, &between) && !between)))
+    {
+        // nothing between -a and -g, or nothing to iterate over:
+        // take the whole container at once
+        result = aggregate_all(container, op, parts);
+    }
+    else
+    {
+        if (!m->agg)
+            {aggregate_reset(agg, op);}
+        m->agg = 1;
+        // the values may be temporaries, their addresses do not last
+        memset(&memo, 0, sizeof(memo));
+        aggregate_fold(agg, op, parts ? walk_path(PEEK, parts) : PEEK, &memo);
+        free(memo.key);
+        free(memo.val);
+        if (!m->fin)
+            {return 1;}
+        result = aggregate_result(agg, op);
+    }
+    // the result replaces the container, the rest of the chain runs once
+    MAPPOP();
+    optind = resume;
+    PUSH(result);
+    return 0;
+}
+
+// sorting (-o)
+// the sort keys are pulled out of every element once into a flat
+// array, then an index array is sorted: runs of it on -T threads,
+// merged pairwise, also in parallel.  ties keep their input order.
+// values order as null < false < true < numbers < strings < arrays < objects
+
+typedef struct
+{
+    json_t* json;
+    union
+    {
+        json_int_t i;
+        double     d;
+    } num;
+    int     rank;
+    int     is_int;
+} sort_key;
+
+sort_key* sort_table;  // ncols keys per element
+int       sort_ncols;
+int*      sort_desc;
+
+int type_rank(json_t* json)
+{
+    if (json == NULL)
+        {return 0;}
+    switch (json_typeof(json))
+    {
+        case JSON_NULL:
+            return 0;
+        case JSON_FALSE:
+            return 1;
+        case JSON_TRUE:
+            return 2;
+        case JSON_INTEGER:
+        case JSON_REAL:
+            return 3;
+        case JSON_STRING:
+            return 4;
+        case JSON_ARRAY:
+            return 5;
+        case JSON_OBJECT:
+        default:
+            return 6;
+    }
+}
+
+void make_key(sort_key* key, json_t* json)
+{
+    key->rank = type_rank(json);
+    key->json = json;
+    key->is_int = json_is_integer(json);
+    if (key->is_int)
+        {key->num.i = json_integer_value(json);}
+    else
+        {key->num.d = json_is_real(json) ? json_real_value(json) : 0;}
+}
+
+double key_number(const sort_key* key)
+{
+    return key->is_int ? (double)key->num.i : key->num.d;
+}
+
+const char** sorted_keys(json_t* json)
+{
+    const char** keys = malloc((json_object_size(json) + 1) * sizeof(char*));
+    void* iter;
+    size_t n = 0;
+    if (!keys)
+        {hard_err("internal error: out of memory");}
+    for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+        {keys[n++] = json_object_iter_key(iter);}
+    qsort(keys, n, sizeof(char*), compare_strcmp);
+    return keys;
+}
+
+json_t* sort_path(json_t* json, char** parts, int desc)
+// walk_path() with the - taken off the first key, "." is the element
+{
+    char* head[2];
+    head[0] = parts[0] + desc;
+    head[1] = NULL;
+    if (head[0][0] == '\0' && (!parts[1] || (!parts[1][0] && !parts[2])))
+        {return json;}
+    json = walk_path(json, head);
+    return json ? walk_path(json, parts + 1) : NULL;
+}
+
+int compare_json(json_t* a, json_t* b);
+
+int compare_key(const sort_key* a, const sort_key* b)
+{
+    if (a->rank != b->rank)
+        {return a->rank < b->rank ? -1 : 1;}
+    switch (a->rank)
+    {
+        case 3:
+            if (a->is_int && b->is_int)
+                {return (a->num.i > b->num.i) - (a->num.i < b->num.i);}
+            return (key_number(a) > key_number(b)) - (key_number(a) < key_number(b));
+        case 4:
+            return strcmp(json_string_value(a->json), json_string_value(b->json));
+        case 5:
+        case 6:
+            return compare_json(a->json, b->json);
+        default:
+            return 0;
+    }
+}
+
+int compare_json(json_t* a, json_t* b)
+// arrays element by element, objects by their sorted keys, then values
+{
+    sort_key ka, kb;
+    const char** keys_a;
+    const char** keys_b;
+    size_t i, na, nb;
+    int r = 0;
+    make_key(&ka, a);
+    make_key(&kb, b);
+    if (ka.rank != kb.rank || ka.rank < 5)
+        {return compare_key(&ka, &kb);}
+    if (ka.rank == 5)
+    {
+        na = json_array_size(a);
+        nb = json_array_size(b);
+        for (i = 0; i < na && i < nb && !r; i++)
+            {r = compare_json(json_array_get(a, i), json_array_get(b, i));}
+        return r ? r : (na > nb) - (na < nb);
+    }
+    na = json_object_size(a);
+    nb = json_object_size(b);
+    keys_a = sorted_keys(a);
+    keys_b = sorted_keys(b);
+    for (i = 0; i < na && i < nb && !r; i++)
+        {r = strcmp(keys_a[i], keys_b[i]);}
+    if (!r)
+        {r = (na > nb) - (na < nb);}
+    for (i = 0; i < na && !r; i++)
+        {r = compare_json(json_object_get(a, keys_a[i]), json_object_get(b, keys_a[i]));}
+    free(keys_a);
+    free(keys_b);
+    return r;
+}
+
+int compare_rows(size_t a, size_t b)
+{
+    int c, r;
+    for (c = 0; c < sort_ncols; c++)
+    {
+        r = compare_key(&sort_table[a * sort_ncols + c], &sort_table[b * sort_ncols + c]);
+        if (r)
+            {return sort_desc[c] ? -r : r;}
+    }
+    return (a > b) - (a < b);
+}
+
+int compare_index(const void* a, const void* b)
+{
+    return compare_rows(*(const size_t*)a, *(const size_t*)b);
+}
+
+typedef struct
+{
+    size_t* from;
+    size_t* to;
+    size_t  lo, mid, hi;  // sorts [lo, hi) or merges [lo, mid) with [mid, hi)
+} sort_job;
+
+void* sort_worker(void* arg)
+{
+    sort_job* job = arg;
+    size_t* a = job->from + job->lo;
+    size_t* b = job->from + job->mid;
+    size_t* a_end = b;
+    size_t* b_end = job->from + job->hi;
+    size_t* out = job->to + job->lo;
+    if (job->mid == job->hi)
+    {
+        qsort(a, job->hi - job->lo, sizeof(size_t), compare_index);
+        memcpy(out, a, (job->hi - job->lo) * sizeof(size_t));
+        return NULL;
+    }
+    while (a < a_end && b < b_end)
+        {*out++ = compare_rows(*b, *a) < 0 ? *b++ : *a++;}
+    memcpy(out, a, (a_end - a) * sizeof(size_t));
+    out += a_end - a;
+    memcpy(out, b, (b_end - b) * sizeof(size_t));
+    return NULL;
+}
+
+size_t* sort_indexes(size_t n)
+// one sorted run per thread, then rounds of pairwise merges
+{
+    sort_job jobs[MAXTHREADS];
+    size_t bounds[MAXTHREADS + 1];
+    size_t* idx = malloc((n + 1) * sizeof(size_t));
+    size_t* tmp = malloc((n + 1) * sizeof(size_t));
+    size_t* swap;
+    size_t i;
+    int t, runs, nt = MAX(1, MIN((size_t)threads, n / AGGMIN));
+
+    if (!idx || !tmp)
+        {hard_err("internal error: out of memory");}
+    for (i = 0; i < n; i++)
+        {idx[i] = i;}
+    for (t = 0; t <= nt; t++)
+        {bounds[t] = n * t / nt;}
+    for (t = 0; t < nt; t++)
+    {
+        jobs[t].from = idx;
+        jobs[t].to = tmp;
+        jobs[t].lo = bounds[t];
+        jobs[t].mid = jobs[t].hi = bounds[t + 1];
+    }
+    run_parallel(sort_worker, jobs, sizeof(sort_job), nt);
+    for (runs = nt; ; runs = (runs + 1) / 2)
+    {
+        swap = idx;
+        idx = tmp;
+        tmp = swap;
+        if (runs == 1)
+            {break;}
+        for (t = 0; t < runs / 2; t++)
+        {
+            jobs[t].from = idx;
+            jobs[t].to = tmp;
+            jobs[t].lo = bounds[2 * t];
+            jobs[t].mid = bounds[2 * t + 1];
+            jobs[t].hi = bounds[2 * t + 2];
+        }
+        // an odd run out is copied as it is
+        if (runs % 2)
+            {memcpy(tmp + bounds[runs - 1], idx + bounds[runs - 1], (n - bounds[runs - 1]) * sizeof(size_t));}
+        run_parallel(sort_worker, jobs, sizeof(sort_job), runs / 2);
+        for (t = 0; t <= runs / 2; t++)
+            {bounds[t] = bounds[MIN(2 * t, runs)];}
+        bounds[(runs + 1) / 2] = n;
+    }
+    free(tmp);
+    return idx;
+}
+
+json_t* sort_array(json_t* json, char* arg)
+// in place, so the parent sees the new order like after -d
+{
+    columns* cols = parse_columns(arg, strlen(arg));
+    char*** paths;
+    char** parts;
+    json_t** items;
+    size_t* idx;
+    size_t i, n;
+    int c;
+
+    if (!json_is_array(json))
+    {
+        json_err("can not be sorted", json);
+        return json;
+    }
+    n = json_array_size(json);
+    sort_ncols = cols->ncols;
+    paths = malloc(sort_ncols * sizeof(char**));
+    sort_desc = malloc(sort_ncols * sizeof(int));
+    sort_table = malloc((n * sort_ncols + 1) * sizeof(sort_key));
+    items = malloc((n + 1) * sizeof(json_t*));
+    if (!paths || !sort_desc || !sort_table || !items)
+        {hard_err("internal error: out of memory");}
+    // a leading - on a key sorts it descending, "." is the element itself
+    parts = cols->parts;
+    for (c = 0; c < sort_ncols; c++)
+    {
+        sort_desc[c] = parts[0][0] == '-';
+        paths[c] = parts;
+        while (*parts++)
+            {;}
+    }
+    for (i = 0; i < n; i++)
+    {
+        items[i] = json_array_get(json, i);
+        for (c = 0; c < sort_ncols; c++)
+            {make_key(&sort_table[i * sort_ncols + c], sort_path(items[i], paths[c], sort_desc[c]));}
+    }
+    idx = sort_indexes(n);
+    for (i = 0; i < n; i++)
+        {json_incref(items[i]);}
+    json_array_clear(json);
+    for (i = 0; i < n; i++)
+        {json_array_append_new(json, items[idx[i]]);}
+    free(idx);
+    free(items);
+    free(sort_table);
+    free(sort_desc);
+    free(paths);
+    return json;
+}
+
+// group-by (-G) and unique-by (-U)
+// one pass over the array with an open addressing table.  -G groups by
+// the key as -u would print it, since that becomes the object key.
+// -U compares the values themselves, by content hash and then json_equal.
+
+typedef struct
+{
+    char*     key;
+    json_t*   members;  // or agg, when -G has an aggregate
+    aggregate agg;
+} group;
+
+char* group_key(json_t* json)
+// allocated, missing fields group with null
+{
+    char* temp;
+    if (json == NULL)
+        {return strdup("null");}
+    if (json_is_string(json))
+        {return strdup(json_string_value(json));}
+    if (json_is_integer(json))
+    {
+        if (asprintf(&temp, "%" JSON_INTEGER_FORMAT, json_integer_value(json)) == -1)
+            {hard_err("internal error: out of memory");}
+        return temp;
+    }
+    return smart_dumps(json, dumps_compact);
+}
+
+size_t* new_slots(size_t n, size_t* mask)
+// index + 1 per slot, at most half full
+{
+    size_t size = 16;
+    size_t* slots;
+    while (size < n * 2)
+        {size *= 2;}
+    slots = calloc(size, sizeof(size_t));
+    if (!slots)
+        {hard_err("internal error: out of memory");}
+    *mask = size - 1;
+    return slots;
+}
+
+json_t* group_by(json_t* json, char* arg)
+{
+    char* eq = strchr(arg, '=');
+    char** path = parse_columns(arg, eq ? (size_t)(eq - arg) : strlen(arg))->parts;
+    json_t* result = json_object();
+    json_t* element;
+    group* groups;
+    size_t* slots;
+    size_t i, n, slot, mask, count = 0;
+    char** parts = NULL;
+    char op = 0;
+    char* key;
+    hash_memo memo;
+
+    if (!json_is_array(json))
+    {
+        json_err("can not be grouped", json);
+        return result;
+    }
+    memset(&memo, 0, sizeof(memo));
+    if (eq)
+        {op = aggregate_op(eq + 1, &parts);}
+    n = json_array_size(json);
+    slots = new_slots(n, &mask);
+    groups = malloc((n + 1) * sizeof(group));
+    if (!groups)
+        {hard_err("internal error: out of memory");}
+    for (i = 0; i < n; i++)
+    {
+        element = json_array_get(json, i);
+        key = group_key(sort_path(element, path, 0));
+        for (slot = hash_bytes(key, strlen(key)) & mask; slots[slot]; slot = (slot + 1) & mask)
+        {
+            if (!strcmp(groups[slots[slot] - 1].key, key))
+                {break;}
+        }
+        if (slots[slot])
+            {free(key);}
+        else
+        {
+            slots[slot] = ++count;
+            groups[count - 1].key = key;
+            if (op)
+                {aggregate_reset(&groups[count - 1].agg, op);}
+            else
+                {groups[count - 1].members = json_array();}
+        }
+        if (op)
+            {aggregate_fold(&groups[slots[slot] - 1].agg, op, parts ? walk_path(element, parts) : element, &memo);}
+        else
+            {json_array_append(groups[slots[slot] - 1].members, element);}
+    }
+    for (i = 0; i < count; i++)
+    {
+        json_object_set_new(result, groups[i].key, op ? aggregate_result(&groups[i].agg, op) : groups[i].members);
+        free(groups[i].key);
+    }
+    free(groups);
+    free(slots);
+    free(memo.key);
+    free(memo.val);
+    return result;
+}
+
+json_t* unique_by(json_t* json, char* arg)
+// keeps the first element for every distinct key value
+{
+    json_t* result = json_array();
+    json_t* element;
+    json_t* value;
+    json_t** seen;
+    uint64_t* hashes;
+    uint64_t h;
+    size_t* slots;
+    size_t i, n, slot, mask, count = 0;
+    char** path = parse_columns(arg, strlen(arg))->parts;
+    hash_memo memo;
+
+    if (!json_is_array(json))
+    {
+        json_err("can not be deduplicated", json);
+        return result;
+    }
+    n = json_array_size(json);
+    slots = new_slots(n, &mask);
+    seen = malloc((n + 1) * sizeof(json_t*));
+    hashes = malloc((n + 1) * sizeof(uint64_t));
+    if (!seen || !hashes)
+        {hard_err("internal error: out of memory");}
+    memset(&memo, 0, sizeof(memo));
+    for (i = 0; i < n; i++)
+    {
+        element = json_array_get(json, i);
+        value = sort_path(element, path, 0);
+        if (value == NULL)
+            {value = json_null();}
+        h = tree_hash(value, &memo, 1);
+        for (slot = h & mask; slots[slot]; slot = (slot + 1) & mask)
+        {
+            if (hashes[slots[slot] - 1] == h && json_equal(seen[slots[slot] - 1], value))
+                {break;}
+        }
+        if (slots[slot])
+            {continue;}
+        slots[slot] = ++count;
+        seen[count - 1] = value;
+        hashes[count - 1] = h;
+        json_array_append(result, element);
+    }
+    free(memo.key);
+    free(memo.val);
+    free(hashes);
+    free(seen);
+    free(slots);
+    return result;
+}
+
+void debug_stack(int optchar)
+{
+    json_t** j;
+    fprintf(out, "BEGIN STACK DUMP %c\n", optchar);
+    for (j=stack; j<stackpointer; j++)
+    {
+        smart_dumpf(*j, 0, out);
+        fputc('\n', out);
+    }
+}
+
+void debug_map()
+{
+    mapping* m;
+    fprintf(out, "BEGIN MAP DUMP\n");
+    for (m=mapstack; m<mapstackpointer; m++)
+    {
+        smart_dumpf(*(m->stk), 0, out);
+        fputc('\n', out);
+    }
+}
+
+int run_actions(int argc, char *argv[])
+// runs the action chain on the stack, returns 1 if it ended inside -a
+{
+    char* arg1 = "";
+    json_t* json = NULL;
+    json_t* jval = NULL;
+    int output = 1;  // flag if json should be printed
+    int optchar;
+    int empty;
+    int jump;
+    int skipped;
+    int mine;        // the popped slot owned its value
+
+    do
+    {
+        if (! MAPEMPTY)
+        {
+            while (map_safe_peek()->fin)
+            {
+                MAPPOP();
+                if (MAPEMPTY)
+                    {return 1;}
+            }
+            MAPNEXT();
+        }
+        while ((optchar = getopt(argc, argv, ALL_OPTIONS)) != -1)
+        {
+            empty = 0;
+            switch (optchar)
+            {
+                case 't':  // id type
+                    fprintf(out, "%s\n", pretty_type(PEEK));
+                    output = 0;
+                    break;
+                case 'l':  // length
+                    fprintf(out, "%i\n", length(PEEK));
+                    output = 0;
+                    break;
+                case 'k':  // keys
+                    keys(PEEK);
+                    output = 0;
+                    break;
+                case 'u':  // unescape string
+                    fprintf(out, "%s%c", unstring(PEEK), delim);
+                    output = 0;
+                    break;
+                case 'p':  // pop stack
+                    json = POP;
+                    drop_slot(stackpointer);
+                    output = 1;
+                    break;
+                case 's':  // load string
+                    arg1 = optarg;
+                    PUSH(json_string(arg1));
+                    output = 1;
+                    break;
+                case 'n':  // load nonstring
+                    arg1 = optarg;
+                    PUSH(nonstring(arg1));
+                    output = 1;
+                    break;
+                case 'e':  // extract
+                    arg1 = optarg;
+                    json = PEEK;
+                    PUSH_SHARED(extract(json, arg1));
+                    output = 1;
+                    break;
+                case 'j':  // json literal
+                    smart_dumpf(PEEK, dumps_compact, out);
+                    fputc(delim, out);
+                    output = 0;
+                    break;
+                case 'd':  // delete
+                    arg1 = optarg;
+                    json = pop_writable();
+                    mine = POPPED;
+                    PUSH(delete(json, arg1));
+                    owned[stackpointer - stack - 1] = mine;
+                    index_reset();
+                    memo_reset();
+                    output = 1;
+                    break;
+                case 'i':  // insert
+                    arg1 = optarg;
+                    jval = POP;
+                    json = pop_writable();
+                    mine = POPPED;
+                    PUSH(update_native(json, arg1, jval));
+                    owned[stackpointer - stack - 1] = mine;
+                    // the tree took its own reference
+                    drop_slot(stackpointer);
+                    index_reset();
+                    memo_reset();
+                    output = 1;
+                    break;
+                case 'x':  // indexed lookup
+                    arg1 = optarg;
+                    json = PEEK;
+                    PUSH_SHARED(lookup(json, arg1));
+                    output = 1;
+                    break;
+                case 'o':  // sort
+                    json = pop_writable();
+                    mine = POPPED;
+                    PUSH(sort_array(json, optarg));
+                    owned[stackpointer - stack - 1] = mine;
+                    index_reset();
+                    memo_reset();
+                    output = 1;
+                    break;
+                case 'G':  // group by
+                    PUSH(group_by(PEEK, optarg));
+                    output = 1;
+                    break;
+                case 'U':  // unique by
+                    PUSH(unique_by(PEEK, optarg));
+                    output = 1;
+                    break;
+                case 'g':  // aggregate
+                    if (aggregate_action(optarg, argc, argv))
+                        {empty = 1;}
+                    output = !empty;
+                    break;
+                case 'y':  // schema summary
+                    PUSH(schema(PEEK));
+                    output = 1;
+                    break;
+                case 'H':  // content hash
+                    fprintf(out, "%016" PRIx64 "\n", hash_all(PEEK));
+                    output = 0;
+                    break;
+                case 'D':  // diff against a file
+                    diff(PEEK, optarg);
+                    output = 0;
+                    break;
+                case 'c':  // tab separated row
+                    row(PEEK, optarg, '\t');
+                    output = 0;
+                    break;
+                case 'v':  // comma separated row
+                    row(PEEK, optarg, ',');
+                    output = 0;
+                    break;
+                case 'a':  // across
+                    // something about -a is not mappable?
+                    MAPPUSH();
+                    empty = map_safe_peek()->fin;
+                    if (!empty)
+                        {MAPNEXT();}
+                    // -g still has a result for an empty container,
+                    // the actions before it have nothing to run on
+                    if (empty && (jump = aggregate_ahead(argc, argv, optind, &skipped)))
+                    {
+                        optind = jump;
+                        empty = 0;
+                    }
+                    output = 0;
+                    break;
+                case 'P':  // not manipulations
+                case 'S': 
+                case 'Q':
+                case 'V':
+                case 'C':
+                case 'I':
+                case 'M':
+                case 'L':
+                case 'f':
+                case 'F':
+                case 'T':
+                case 'R':
+                case 'K':
+                case 'N':
+                case 'E':
+                case 'z':
+                case 'O':
+                case 'A':
+                case 'm':
+                case '0':
+                    break;
+                default:
+                    if (crash)
+                        {exit(2);}
+                    break;
+            }
+            if (empty)
+                {break;}
+        }
+        if (!in_place && output && stackpointer != stack)
+            {write_document(PEEK, out);}
+    } while (! MAPEMPTY);
+    return 0;
+}
+
+// line-delimited records (-L)
+// every line is its own json document and gets the whole action chain.
+// output is collected per batch of lines so a failed record can be
+// taken back, and so forked workers can hand back whole batches in
+// input order.  workers are processes rather than threads because
+// getopt, the edit stack and the mapstack are all global.
+
+#define BATCHLINES 4096
+
+typedef struct
+{
+    size_t len;
+    size_t errlen;  // stderr text, after the output
+    int    abort;
+} batch_frame;
+
+// a worker holds its stderr per batch as well, so messages come out in
+// input order and none for the batches after an abort
+FILE*  held_err = NULL;
+char*  held_buf = NULL;
+size_t held_size = 0;
+
+void release_held_err()
+// at exit, a fatal error outside any record still gets out
+{
+    if (held_err == NULL)
+        {return;}
+    fflush(held_err);
+    if (write(fileno(stderr), held_buf, held_size) < 0)
+        {return;}
+}
+
+long record_mark;
+
+int record_fail()
+// applies -R, returns 1 if the run should stop
+{
+    switch (record_policy)
+    {
+        case 's':
+            fseek(out, record_mark, SEEK_SET);
+            return 0;
+        case 'n':
+            fseek(out, record_mark, SEEK_SET);
+            write_document(json_null(), out);
+            return 0;
+        case 'a':
+        default:
+            return 1;
+    }
+}
+
+int run_record(char* text, size_t len, size_t line, int argc, char* argv[])
+// returns 1 if the run should stop
+{
+    json_t* json;
+    json_error_t error;
+    char* p;
+
+    for (p = text; p < text + len && JSON_WHITE(*p); p++)
+        {;}
+    if (p == text + len)
+        {return 0;}
+
+    stackpointer = stack;
+    mapstackpointer = mapstack;
+    index_reset();
+    memo_reset();
+#ifdef __GLIBC__
+    optind = 0;  // also drops a half read group of short options
+#else
+    optind = 1;
+#endif
+#ifdef BSD
+    optreset = 1;
+#endif
+    record_mark = ftell(out);
+    if (setjmp(record_jmp))
+    {
+        in_record = 0;
+        map_release();
+        return record_fail();
+    }
+
+    json = compat_json_loadb(text, len, &error);
+    if (!json)
+    {
+#if JANSSON_MAJOR_VERSION < 2
+        if (!quiet)
+            {fprintf(errout, "json read error: line %zu: %s\n", line, error.text);}
+#else
+        if (!quiet)
+            {fprintf(errout, "json read error: line %zu column %0d: %s\n", line, error.column, error.text);}
+#endif
+        return record_fail();
+    }
+    PUSH(json);
+    in_record = 1;
+    run_actions(argc, argv);
+    in_record = 0;
+    map_release();
+    return 0;
+}
+
+int run_batch(char* start, char* end, size_t line, int argc, char* argv[])
+{
+    char* eol;
+    for (; start < end; start = eol + 1, line++)
+    {
+        eol = memchr(start, '\n', end - start);
+        if (eol == NULL)
+            {eol = end;}
+        if (run_record(start, eol - start, line, argc, argv))
+            {return 1;}
+    }
+    return 0;
+}
+
+int write_full(int fd, char* buf, size_t len)
+{
+    char* p;
+    ssize_t n;
+    for (p = buf; p < buf + len; p += n)
+    {
+        n = write(fd, p, buf + len - p);
+        if (n < 0)
+            {return -1;}
+    }
+    return 0;
+}
+
+int batch_to(int fd, char* start, char* end, size_t line, int argc, char* argv[])
+// runs one batch into memory, then writes it to fd with a frame header
+// if fd is -1 the output goes straight to stdout
+{
+    batch_frame frame;
+    char* buf = NULL;
+    size_t size = 0;
+
+    out = open_memstream(&buf, &size);
+    if (out == NULL)
+        {hard_err("internal error: out of memory");}
+    if (fd >= 0)
+    {
+        held_err = open_memstream(&held_buf, &held_size);
+        if (held_err == NULL)
+            {hard_err("internal error: out of memory");}
+        errout = held_err;
+    }
+    frame.abort = run_batch(start, end, line, argc, argv);
+    fflush(out);
+    frame.len = ftell(out);
+    fclose(out);
+    out = stdout;
+    if (fd < 0)
+    {
+        fwrite(buf, 1, frame.len, stdout);
+        free(buf);
+        return frame.abort;
+    }
+    fflush(held_err);
+    frame.errlen = ftell(held_err);
+    fclose(held_err);
+    held_err = NULL;
+    errout = stderr;
+    if (write_full(fd, (char*)&frame, sizeof(frame)) || write_full(fd, buf, frame.len)
+        || write_full(fd, held_buf, frame.errlen))
+        {exit(1);}
+    free(buf);
+    free(held_buf);
+    held_buf = NULL;
+    return frame.abort;
+}
+
+int read_full(int fd, void* buf, size_t len)
+{
+    char* p = buf;
+    ssize_t n;
+    while (len)
+    {
+        n = read(fd, p, len);
+        if (n <= 0)
+            {return -1;}
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void run_lines(char* content, size_t len, int argc, char* argv[])
+// exits when done
+{
+    char** cuts;
+    char* p;
+    char* end = content + len;
+    size_t i, n = 0, cap = 64;
+    pid_t pids[MAXTHREADS];
+    int fds[MAXTHREADS][2];
+    int t, status = 0;
+    batch_frame frame;
+    char* buf;
+
+    // batch boundaries, every BATCHLINES lines
+    cuts = malloc(cap * sizeof(char*));
+    if (!cuts)
+        {hard_err("internal error: out of memory");}
+    cuts[n++] = content;
+    for (p = content; p < end; )
+    {
+        for (i = 0; i < BATCHLINES && p < end; i++)
+        {
+            p = memchr(p, '\n', end - p);
+            p = p ? p + 1 : end;
+        }
+        if (n == cap)
+        {
+            cap *= 2;
+            if (!(cuts = realloc(cuts, cap * sizeof(char*))))
+                {hard_err("internal error: out of memory");}
+        }
+        cuts[n++] = p;
+    }
+    n--;
+
+    if (threads < 2 || n < 2)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (batch_to(-1, cuts[i], cuts[i + 1], i * BATCHLINES + 1, argc, argv))
+                {exit(1);}
+        }
+        exit(0);
+    }
+
+    fflush(stdout);
+    for (t = 0; t < threads; t++)
+    {
+        if (pipe(fds[t]))
+            {hard_err("internal error: could not start workers");}
+        pids[t] = fork();
+        if (pids[t] < 0)
+            {hard_err("internal error: could not start workers");}
+        if (pids[t] == 0)
+        {
+            close(fds[t][0]);
+            spill_detach();
+            atexit(release_held_err);
+            for (i = t; i < n; i += threads)
+            {
+                if (batch_to(fds[t][1], cuts[i], cuts[i + 1], i * BATCHLINES + 1, argc, argv))
+                    {exit(1);}
+            }
+            exit(0);
+        }
+        close(fds[t][1]);
+    }
+
+    // reorder buffer: batch i always comes from worker i % threads
+    // the first abort stops the workers, later batches are never shown
+    for (i = 0; i < n && !status; i++)
+    {
+        t = i % threads;
+        if (read_full(fds[t][0], &frame, sizeof(frame)))
+            {status = 1; break;}
+        buf = malloc(frame.len + frame.errlen + 1);
+        if (!buf)
+            {hard_err("internal error: out of memory");}
+        if (read_full(fds[t][0], buf, frame.len + frame.errlen))
+            {status = 1;}
+        else
+        {
+            fwrite(buf + frame.len, 1, frame.errlen, stderr);
+            fwrite(buf, 1, frame.len, stdout);
+        }
+        free(buf);
+        status |= frame.abort;
+    }
+    for (t = 0; t < threads; t++)
+    {
+        close(fds[t][0]);
+        if (status)
+            {kill(pids[t], SIGTERM);}
+        waitpid(pids[t], NULL, 0);
+    }
+    exit(status);
+}
+
+// follow mode (-f)
+// like tail -F: runs the records already in the file, then waits for
+// more and runs each complete line as it arrives.  a partial last line
+// waits until its newline shows up.  truncation starts over from the
+// top, a rotated or recreated file is picked up under the same path.
+// inotify on linux, otherwise the file is checked a few times a second.
+
+#define FOLLOWBUF  (1 << 16)
+#define FOLLOWWAIT 1000  // ms, also the safety net next to inotify
+
+int follow_open(char* path, struct stat* st)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, st))
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int follow_watch(int ifd, char* path, int wd)
+// moves the watch wd over to the file now at path, returns the new one
+{
+#ifdef __linux__
+    if (ifd < 0)
+        {return -1;}
+    // a rotated file would otherwise keep its watch, and its events
+    if (wd >= 0)
+        {inotify_rm_watch(ifd, wd);}
+    return inotify_add_watch(ifd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+    (void)ifd;
+    (void)path;
+    (void)wd;
+    return -1;
+#endif
+}
+
+void follow_wait(int ifd)
+{
+    struct pollfd pfd;
+    char events[4096];
+    if (ifd < 0)
+    {
+        poll(NULL, 0, FOLLOWWAIT / 4);
+        return;
+    }
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, FOLLOWWAIT) > 0)
+    {
+        while (read(ifd, events, sizeof(events)) > 0)
+            {;}
+    }
+}
+
+size_t follow_run(char* buf, size_t len, size_t* line, int argc, char* argv[])
+// runs the complete lines, returns how many bytes it used
+{
+    char* end = buf + len;
+    char* p;
+    while (end > buf && end[-1] != '\n')
+        {end--;}
+    if (end == buf)
+        {return 0;}
+    if (batch_to(-1, buf, end - 1, *line, argc, argv))
+        {exit(1);}
+    fflush(stdout);
+    for (p = buf; (p = memchr(p, '\n', end - p)); p++)
+        {(*line)++;}
+    return end - buf;
+}
+
+void follow_lines(char* path, int argc, char* argv[])
+// never returns
+{
+    struct stat st, now;
+    char* buf;
+    char* dir;
+    size_t len = 0, cap = FOLLOWBUF, used, line = 1;
+    off_t offset = 0;
+    ssize_t n;
+    int fd, ifd = -1, wd, draining = 0;
+
+    fd = follow_open(path, &st);
+    if (fd < 0)
+    {
+        fprintf(errout, "unable to read file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+#ifdef __linux__
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0)
+    {
+        // the directory tells when a rotated file is created again
+        dir = strdup(path);
+        if (dir)
+            {inotify_add_watch(ifd, dirname(dir), IN_CREATE | IN_MOVED_TO);}
+        free(dir);
+    }
+#else
+    (void)dir;
+#endif
+    wd = follow_watch(ifd, path, -1);
+    buf = malloc(cap);
+    if (!buf)
+        {hard_err("internal error: out of memory");}
+
+    for (;;)
+    {
+        while (fd >= 0 && (n = read(fd, buf + len, cap - len)) > 0)
+        {
+            len += n;
+            offset += n;
+            used = follow_run(buf, len, &line, argc, argv);
+            memmove(buf, buf + used, len - used);
+            len -= used;
+            if (len == cap && !(buf = realloc(buf, cap *= 2)))
+                {hard_err("internal error: out of memory");}
+        }
+        if (stat(path, &now) == 0 && (fd < 0 || now.st_ino != st.st_ino || now.st_dev != st.st_dev))
+        {
+            // rotated: read the old file to its end once more, then switch
+            if (!draining++)
+                {continue;}
+            draining = 0;
+            if (len && batch_to(-1, buf, buf + len, line++, argc, argv))
+                {exit(1);}
+            fflush(stdout);
+            len = 0;
+            offset = 0;
+            if (fd >= 0)
+                {close(fd);}
+            fd = follow_open(path, &st);
+            wd = follow_watch(ifd, path, wd);
+            continue;
+        }
+        if (fd >= 0 && fstat(fd, &now) == 0 && now.st_size < offset)
+        {
+            if (!quiet)
+                {fprintf(errout, "jshon: %s: file truncated\n", path);}
+            lseek(fd, 0, SEEK_SET);
+            offset = 0;
+            len = 0;
+            continue;
+        }
+        follow_wait(ifd);
+    }
+}
+
+// offset index (-K, -N)
+// a sidecar file next to the -F input, path.idx, holding the byte offset
+// of every Nth line.  -N starts from the closest entry at or before each
+// wanted line and skips the rest of the way, so a record deep in a huge
+// file costs at most N lines of reading instead of everything before it.
+// the header keeps the size and mtime the index was built against and a
+// hash of the last bytes it covers.  an exact match is trusted, a file
+// that only grew reuses the covered part (and -K extends it), anything
+// else is stale.  native endian, not portable between machines.
+
+#define SEEKMAGIC "jshonidx"
+#define SEEKCHUNK (1 << 20)
+#define SEEKTAIL  4096  // bytes hashed at the end of the covered part
+
+#define SEEK_NONE  0
+#define SEEK_STALE 1
+#define SEEK_GREW  2
+#define SEEK_FRESH 3
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t stride;    // lines between entries
+    uint64_t size;      // bytes covered
+    int64_t  mtime;
+    int64_t  mtime_ns;
+    uint64_t lines;     // newlines in the covered part
+    uint64_t tail;      // hash_bytes() of its last SEEKTAIL bytes
+} seek_header;
+
+typedef struct
+{
+    uint64_t first;
+    uint64_t last;
+} seek_range;
+
+uint64_t index_stride = 0;  // -K
+seek_range* selects = NULL; // -N
+size_t select_count = 0;
+
+int select_parse(char* list)
+// "5,10-20,300-" into selects, 0 if it does not parse
+{
+    seek_range r;
+    char* p = list;
+    char* end;
+    while (*p)
+    {
+        if (!isdigit((unsigned char)*p))
+            {return 0;}
+        r.first = strtoull(p, &end, 10);
+        r.last = r.first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            r.last = UINT64_MAX;
+            if (isdigit((unsigned char)*p))
+                {r.last = strtoull(p, &end, 10);}
+            else
+                {end = p;}
+        }
+        if (r.first < 1 || r.last < r.first || (*end && *end != ','))
+            {return 0;}
+        selects = realloc(selects, (select_count + 1) * sizeof(seek_range));
+        if (!selects)
+            {hard_err("internal error: out of memory");}
+        selects[select_count++] = r;
+        p = end;
+        // a comma always has a selector after it
+        if (*p == ',' && !*++p)
+            {return 0;}
+    }
+    return select_count > 0;
+}
+
+size_t newline_scalar(const unsigned char* s, size_t n, uint64_t* left)
+// position of the *left-th newline, or n with *left lowered by the
+// newlines that were passed
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        if (s[i] == '\n' && !--*left)
+            {return i;}
+    }
+    return n;
+}
+
+#ifdef HAVE_SIMD
+__attribute__((target("sse2")))
+size_t newline_sse2(const unsigned char* s, size_t n, uint64_t* left)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    unsigned mask, hits;
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + i)), nl));
+        hits = __builtin_popcount(mask);
+        if (hits < *left)
+        {
+            *left -= hits;
+            continue;
+        }
+        while (--*left)
+            {mask &= mask - 1;}
+        return i + __builtin_ctz(mask);
+    }
+    return i + newline_scalar(s + i, n - i, left);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t newline_avx2(const unsigned char* s, size_t n, uint64_t* left)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    unsigned mask, hits;
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i)), nl));
+        hits = __builtin_popcount(mask);
+        if (hits < *left)
+        {
+            *left -= hits;
+            continue;
+        }
+        while (--*left)
+            {mask &= mask - 1;}
+        return i + __builtin_ctz(mask);
+    }
+    return i + newline_sse2(s + i, n - i, left);
+}
+#endif
+
+size_t (*newline_scan)(const unsigned char*, size_t, uint64_t*) = newline_scalar;
+
+void pick_newline_scan()
+{
+#ifdef HAVE_SIMD
+    if (simd_level() >= 1)
+        {newline_scan = newline_sse2;}
+    if (simd_level() >= 2)
+        {newline_scan = newline_avx2;}
+#endif
+}
+
+uint64_t seek_tail(int fd, uint64_t size)
+// 0 if it can not be read, hash_bytes() never returns 0
+{
+    char buf[SEEKTAIL];
+    size_t n = size < SEEKTAIL ? size : SEEKTAIL;
+    if (pread(fd, buf, n, size - n) != (ssize_t)n)
+        {return 0;}
+    return hash_bytes(buf, n);
+}
+
+int seek_load(char* idx, int fd, struct stat* st, seek_header* head, uint64_t** entries, size_t* count)
+// reads the sidecar and says how far it can be trusted
+{
+    struct stat ist;
+    FILE* fp;
+    int state = SEEK_STALE;
+    *entries = NULL;
+    *count = 0;
+    fp = fopen(idx, "rb");
+    if (!fp)
+        {return SEEK_NONE;}
+    if (fread(head, sizeof(seek_header), 1, fp) != 1 || memcmp(head->magic, SEEKMAGIC, 8)
+        || head->version != 1 || !head->stride || fstat(fileno(fp), &ist))
+        {goto done;}
+    *count = (ist.st_size - sizeof(seek_header)) / sizeof(uint64_t);
+    // a half written index does not add up
+    if (*count != head->lines / head->stride + 1)
+        {goto done;}
+    if ((uint64_t)st->st_size == head->size && st->st_mtim.tv_sec == head->mtime && st->st_mtim.tv_nsec == head->mtime_ns)
+        {state = SEEK_FRESH;}
+    else if ((uint64_t)st->st_size > head->size && seek_tail(fd, head->size) == head->tail)
+        {state = SEEK_GREW;}
+    else
+        {goto done;}
+    *entries = malloc(*count * sizeof(uint64_t));
+    if (!*entries)
+        {hard_err("internal error: out of memory");}
+    if (fread(*entries, sizeof(uint64_t), *count, fp) != *count)
+    {
+        free(*entries);
+        *entries = NULL;
+        state = SEEK_STALE;
+    }
+done:
+    if (state == SEEK_STALE)
+        {*count = 0;}
+    fclose(fp);
+    return state;
+}
+
+int seek_open(char* path, struct stat* st)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, st))
+    {
+        fprintf(errout, "unable to read file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+void seek_build(char* path, char* idx, uint64_t stride)
+// -K: writes the index, or extends it when the file only grew
+{
+    struct stat st;
+    seek_header head;
+    uint64_t* entries;
+    uint64_t entry, left, want;
+    size_t count, i;
+    ssize_t n;
+    char* buf;
+    FILE* fp;
+    int fd, state;
+
+    fd = seek_open(path, &st);
+    state = seek_load(idx, fd, &st, &head, &entries, &count);
+    free(entries);
+    if (state == SEEK_FRESH && head.stride == stride)
+    {
+        close(fd);
+        return;
+    }
+    if (state == SEEK_GREW && head.stride == stride)
+        {fp = fopen(idx, "r+b");}
+    else
+    {
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, SEEKMAGIC, 8);
+        head.version = 1;
+        head.stride = stride;
+        fp = fopen(idx, "w+b");
+        entry = 0;
+        if (fp && (fwrite(&head, sizeof(head), 1, fp) != 1 || fwrite(&entry, sizeof(entry), 1, fp) != 1))
+            {goto fail;}
+    }
+    if (!fp || fseek(fp, 0, SEEK_END))
+        {goto fail;}
+
+    buf = malloc(SEEKCHUNK);
+    if (!buf)
+        {hard_err("internal error: out of memory");}
+    pick_newline_scan();
+    // only up to the size seen above, so the header describes what was read
+    left = stride - head.lines % stride;
+    for (; head.size < (uint64_t)st.st_size; head.size += n)
+    {
+        want = (uint64_t)st.st_size - head.size;
+        n = pread(fd, buf, want < SEEKCHUNK ? want : SEEKCHUNK, head.size);
+        if (n <= 0)
+            {goto fail;}
+        for (i = 0; i < (size_t)n; )
+        {
+            want = left;
+            i += newline_scan((unsigned char*)buf + i, n - i, &left);
+            head.lines += want - left;
+            if (left)
+                {break;}
+            i++;
+            entry = head.size + i;
+            if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+                {goto fail;}
+            left = stride;
+        }
+    }
+    free(buf);
+    head.mtime = st.st_mtim.tv_sec;
+    head.mtime_ns = st.st_mtim.tv_nsec;
+    head.tail = seek_tail(fd, head.size);
+    if (fseek(fp, 0, SEEK_SET) || fwrite(&head, sizeof(head), 1, fp) != 1 || fclose(fp))
+        {goto fail;}
+    close(fd);
+    return;
+fail:
+    fprintf(errout, "unable to write index %s: %s\n", idx, strerror(errno));
+    exit(1);
+}
+
+typedef struct
+{
+    int    fd;
+    off_t  pos;   // file offset of buf[0]
+    char*  buf;
+    size_t start; // first unread byte
+    size_t len;
+    size_t cap;
+} line_reader;
+
+int reader_fill(line_reader* r)
+// keeps the unread part and reads more behind it, 0 at end of file
+{
+    ssize_t n;
+    if (r->start)
+    {
+        memmove(r->buf, r->buf + r->start, r->len - r->start);
+        r->pos += r->start;
+        r->len -= r->start;
+        r->start = 0;
+    }
+    if (r->len == r->cap)
+    {
+        r->cap *= 2;
+        if (!(r->buf = realloc(r->buf, r->cap)))
+            {hard_err("internal error: out of memory");}
+    }
+    n = pread(r->fd, r->buf + r->len, r->cap - r->len, r->pos + r->len);
+    if (n < 0)
+    {
+        fprintf(errout, "read error: %s\n", strerror(errno));
+        exit(1);
+    }
+    r->len += n;
+    return n > 0;
+}
+
+void reader_seek(line_reader* r, off_t offset)
+// keeps the buffer when the offset is already in it
+{
+    if (offset >= r->pos && offset <= r->pos + (off_t)r->len)
+        {r->start = offset - r->pos;}
+    else
+    {
+        r->pos = offset;
+        r->start = 0;
+        r->len = 0;
+    }
+}
+
+int reader_skip(line_reader* r, uint64_t lines)
+// moves past that many newlines, 0 if the file ends first
+{
+    size_t i;
+    while (lines)
+    {
+        i = newline_scan((unsigned char*)r->buf + r->start, r->len - r->start, &lines);
+        if (!lines)
+            {r->start += i + 1;}
+        else
+        {
+            r->start = r->len;
+            if (!reader_fill(r))
+                {return 0;}
+        }
+    }
+    return 1;
+}
+
+char* reader_line(line_reader* r, size_t* len)
+// the next line without its newline, NULL at end of file
+{
+    char* eol;
+    char* line;
+    size_t seen = 0;
+    while (!(eol = memchr(r->buf + r->start + seen, '\n', r->len - r->start - seen)))
+    {
+        seen = r->len - r->start;
+        if (reader_fill(r))
+            {continue;}
+        if (r->start == r->len)
+            {return NULL;}
+        eol = r->buf + r->len;
+        break;
+    }
+    line = r->buf + r->start;
+    *len = eol - line;
+    r->start = eol - r->buf;
+    if (r->start < r->len)
+        {r->start++;}
+    return line;
+}
+
+void seek_select(char* path, char* idx, int argc, char* argv[])
+// -N: runs the actions on the listed lines only, in the order listed
+{
+    struct stat st;
+    seek_header head;
+    line_reader r;
+    uint64_t* entries;
+    uint64_t line, k, skip, at = 0;  // at: line number of the reader position
+    size_t count, s, n;
+    char* text;
+    int state;
+
+    r.fd = seek_open(path, &st);
+    state = seek_load(idx, r.fd, &st, &head, &entries, &count);
+    if (state == SEEK_STALE && !quiet)
+        {fprintf(errout, "jshon: index %s is stale, rebuild it with -K\n", idx);}
+    r.pos = 0;
+    r.start = 0;
+    r.len = 0;
+    r.cap = SEEKCHUNK;
+    r.buf = malloc(r.cap);
+    if (!r.buf)
+        {hard_err("internal error: out of memory");}
+    pick_newline_scan();
+
+    for (s = 0; s < select_count; s++)
+    {
+        line = selects[s].first;
+        // nearest entry, unless reading on from here is shorter
+        k = count ? (line - 1) / head.stride : 0;
+        if (k >= count && count)
+            {k = count - 1;}
+        skip = line - 1 - k * (count ? head.stride : 0);
+        if (at && line >= at && line - at <= skip)
+            {skip = line - at;}
+        else
+            {reader_seek(&r, count ? (off_t)entries[k] : 0);}
+        at = 0;
+        if (!reader_skip(&r, skip))
+            {continue;}
+        for (; line <= selects[s].last && (text = reader_line(&r, &n)); line++)
+        {
+            if (batch_to(-1, text, text + n, line, argc, argv))
+                {exit(1);}
+            at = line + 1;
+        }
+        fflush(stdout);
+    }
+    free(r.buf);
+    free(entries);
+    close(r.fd);
+}
+
+int main (int argc, char *argv[])
+{
+    char* content = "";
+    size_t content_len = 0;
+    FILE* fp;
+    json_t* json = NULL;
+    json_error_t error;
+    int optchar;
+    int guessed = 0;  // in_format came from detect_format()
+    int jsonp = 0;   // 1 if we should tolerate JSONP wrapping, 2 once detected
+    int jsonp_rows = 0, jsonp_cols = 0;   // rows+cols skipped over by JSONP prologue
+    char* index_path;
+    char* endptr;
+    char* body;      // the json inside any wrapper
+    size_t body_len;
+    g_argv = argv;
+    out = stdout;
+    errout = stderr;
+
+    // todo: get more jsonp stuff out of main
+
+    threads = MAX(1, MIN(MAXTHREADS, sysconf(_SC_NPROCESSORS_ONLN)));
+
+    // avoiding getopt_long for now because the BSD version is a pain
+    if (argc == 2 && strncmp(argv[1], "--version", 9) == 0)
+        {printf("%i\n", JSHONVER); exit(0);}
+
+    // non-manipulation options
+    while ((optchar = getopt(argc, argv, ALL_OPTIONS)) != -1)
+    {
+        switch (optchar)
+        {
+            case 'P':
+                jsonp = 1;
+                break;
+            case 'S':
+                dumps_flags &= ~JSON_PRESERVE_ORDER;
+                dumps_flags |= JSON_SORT_KEYS;
+                dumps_compact &= ~JSON_PRESERVE_ORDER;
+                dumps_compact |= JSON_SORT_KEYS;
+                break;
+            case 'Q':
+                quiet = 1;
+                break;
+            case 'V':
+                by_value = 1;
+                break;
+            case 'C':
+                crash = 0;
+                break;
+            case 'I':
+                in_place = 1;
+                break;
+            case 'M':
+                lean = 1;
+                break;
+            case 'L':
+                records = 1;
+                break;
+            case 'f':
+                records = 1;
+                follow = 1;
+                break;
+            case 'R':
+                if (strcmp(optarg, "abort") && strcmp(optarg, "skip") && strcmp(optarg, "null"))
+                    {arg_err("parse error: illegal record policy on arg %i, \"%s\"");}
+                else
+                    {record_policy = optarg[0];}
+                break;
+            case 'F':
+                file_path = (char*) strdup(optarg);
+                break;
+            case 'T':
+                threads = atoi(optarg);
+                if (threads < 1 || threads > MAXTHREADS)
+                {
+                    arg_err("parse error: illegal thread count on arg %i, \"%s\"");
+                    threads = 1;
+                }
+                break;
+            case 'z':
+                placeholder = optarg;
+                break;
+            case 'O':
+                out_format = parse_format(optarg, 0);
+                break;
+            case 'A':
+                in_format = parse_format(optarg, 1);
+                break;
+            case 'm':
+                budget = parse_size(optarg);
+                break;
+            case 'K':
+                index_stride = strtoull(optarg, &endptr, 10);
+                if (!isdigit((unsigned char)optarg[0]) || *endptr || !index_stride || index_stride > UINT32_MAX)
+                {
+                    arg_err("parse error: illegal index stride on arg %i, \"%s\"");
+                    index_stride = 0;
+                }
+                break;
+            case 'E':
+                prologue = optarg;
+                break;
+            case 'N':
+                if (!select_parse(optarg))
+                    {arg_err("parse error: illegal line list on arg %i, \"%s\"");}
+                break;
+            case '0':
+                delim = '\0';
+                break;
+            case 't':
+            case 'l':
+            case 'k':
+            case 'u':
+            case 'p':
+            case 'e':
+            case 'j':
+            case 's':
+            case 'n':
+            case 'd':
+            case 'i':
+            case 'a':
+            case 'x':
+            case 'H':
+            case 'y':
+            case 'g':
+            case 'o':
+            case 'G':
+            case 'U':
+            case 'D':
+            case 'c':
+            case 'v':
+                break;
+            default:
+                if (!quiet)
+                    {fprintf(errout, "Valid: -[P|S|Q|V|C|I|M|L|f|0] [-F path] [-T threads] [-R abort|skip|null] [-z text] [-O json|cbor|msgpack] [-A auto|json|cbor|msgpack] [-m size] [-K stride] [-N lines] [-E prologue] -[t|l|k|u|p|a|j|H|y] -[s|n] value -[e|i|d] index -x field=value -D path -[c|v] fields -g op[:path] -o keys -G path[=op[:path]] -U path\n");}
+                if (crash)
+                    {exit(2);}
+                break;
+        }
     }
     optind = 1;
 #ifdef BSD
     optreset = 1;
 #endif
+    // -C carries on past lines that do not parse as well
+    if (!record_policy)
+        {record_policy = crash ? 'a' : 's';}
+
+    // serialized output goes out in large blocks, a tty stays line buffered
+    if (!isatty(fileno(stdout)))
+        {setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZ);}
+
+    if (lean || budget)
+        {lean_init();}
 
     if (in_place && strlen(file_path)==0)
         {err("warning: in-place editing (-I) requires -F");}
 
+    if (follow)
+    {
+        if (strlen(file_path) == 0 || !strcmp(file_path, "-"))
+            {hard_err("error: follow mode (-f) requires -F");}
+        if (in_place)
+            {err("warning: in-place editing (-I) does not work with -f");}
+        if (in_format == FORMAT_CBOR || in_format == FORMAT_MSGPACK)
+            {err("warning: -f records are always json");}
+        in_place = 0;
+        follow_lines(file_path, argc, argv);
+    }
+
+    if (index_stride || select_count)
+    {
+        if (strlen(file_path) == 0 || !strcmp(file_path, "-"))
+            {hard_err("error: the offset index (-K, -N) requires -F");}
+        if (in_place)
+            {err("warning: in-place editing (-I) does not work with -N");}
+        if (asprintf(&index_path, "%s.idx", file_path) == -1)
+            {hard_err("internal error: out of memory");}
+        if (index_stride)
+            {seek_build(file_path, index_path, index_stride);}
+        if (select_count)
+            {seek_select(file_path, index_path, argc, argv);}
+        exit(0);
+    }
+
     if (!strcmp(file_path, "-"))
-        {content = read_stdin();}
+        {content = read_stdin(&content_len);}
     else if (strlen(file_path) > 0)
-        {content = read_file(file_path);}
+        {content = read_file(file_path, &content_len);}
     else
-        {content = read_stdin();}
+        {content = read_stdin(&content_len);}
     if (!content) {
-      fprintf(stderr, "error: failed to read input\n");
+      fprintf(errout, "error: failed to read input\n");
       exit(1);
     }
 
-    if (jsonp)
-        {content = remove_jsonp_callback(content, &jsonp_rows, &jsonp_cols);}
+    if (records)
+    {
+        if (in_place)
+            {err("warning: in-place editing (-I) does not work with -L");}
+        if (in_format == FORMAT_CBOR || in_format == FORMAT_MSGPACK)
+            {err("warning: -L records are always json");}
+        in_place = 0;
+        run_lines(content, content_len, argc, argv);
+    }
+
+    // a wrapper only ever goes around json text
+    if ((jsonp || prologue) && in_format == FORMAT_AUTO)
+        {in_format = FORMAT_JSON;}
+    if (in_format == FORMAT_AUTO)
+    {
+        in_format = detect_format(content, content_len);
+        guessed = 1;
+    }
+
+    body = content;
+    body_len = content_len;
+    if (in_format != FORMAT_JSON)
+    {
+        if (content_len)
+            {json = binary_loads(content, content_len, in_format, guessed);}
+        // a wrong guess is more likely broken json, report it as that
+        if (!json)
+            {in_format = FORMAT_JSON;}
+    }
+    if (in_format == FORMAT_JSON && (jsonp || prologue))
+        {body = strip_wrapper(content, &body_len, prologue, &jsonp, &jsonp_rows, &jsonp_cols);}
 
-    if (content[0])
-        {json = compat_json_loads(content, &error);}
+    if (in_format == FORMAT_JSON && body_len)
+    {
+        json = parallel_loads(body, body_len);
+        if (!json)
+            {json = compat_json_loadb(body, body_len, &error);}
+    }
 
-    if (!json && content[0])
+    if (!json && body_len)
     {
         const char *jsonp_status = "";
         if (jsonp)
-            {jsonp_status = (jsonp_rows||jsonp_cols) ? "(jsonp detected) " : "(jsonp not detected) ";}
+            {jsonp_status = jsonp == 2 ? "(jsonp detected) " : "(jsonp not detected) ";}
 
 #if JANSSON_MAJOR_VERSION < 2
         if (!quiet)
-            {fprintf(stderr, "json %sread error: line %0d: %s\n",
+            {fprintf(errout, "json %sread error: line %0d: %s\n",
                  jsonp_status, error.line + jsonp_rows, error.text);}
 #else
+        // only the first line of the body shares its line with the wrapper
         if (!quiet)
-            {fprintf(stderr, "json %sread error: line %0d column %0d: %s\n",
-                jsonp_status, error.line + jsonp_rows, error.column + jsonp_cols, error.text);}
+            {fprintf(errout, "json %sread error: line %0d column %0d: %s\n",
+                jsonp_status, error.line + jsonp_rows, error.column + (error.line == 1 ? jsonp_cols : 0), error.text);}
 #endif
         exit(1);
     }
@@ -973,112 +5994,20 @@ int main (int argc, char *argv[])
     if (json)
         {PUSH(json);}
 
-    do
-    {
-        if (! MAPEMPTY)
-        {
-            while (map_safe_peek()->fin)
-            {
-                MAPPOP();
-                if (MAPEMPTY)
-                    {exit(0);}
-            }
-            MAPNEXT();
-        }
-        while ((optchar = getopt(argc, argv, ALL_OPTIONS)) != -1)
-        {
-            empty = 0;
-            switch (optchar)
-            {
-                case 't':  // id type
-                    printf("%s\n", pretty_type(PEEK));
-                    output = 0;
-                    break;
-                case 'l':  // length
-                    printf("%i\n", length(PEEK));
-                    output = 0;
-                    break;
-                case 'k':  // keys
-                    keys(PEEK);
-                    output = 0;
-                    break;
-                case 'u':  // unescape string
-                    printf("%s%c", unstring(PEEK), delim);
-                    output = 0;
-                    break;
-                case 'p':  // pop stack
-                    json = POP;
-                    if (by_value)
-                        {json_decref(json);}
-                    output = 1;
-                    break;
-                case 's':  // load string
-                    arg1 = (char*) strdup(optarg);
-                    PUSH(json_string(arg1));
-                    output = 1;
-                    break;
-                case 'n':  // load nonstring
-                    arg1 = (char*) strdup(optarg);
-                    PUSH(nonstring(arg1));
-                    output = 1;
-                    break;
-                case 'e':  // extract
-                    arg1 = (char*) strdup(optarg);
-                    json = PEEK;
-                    PUSH(extract(maybe_deep(json), arg1));
-                    output = 1;
-                    break;
-                case 'j':  // json literal
-                    printf("%s%c", smart_dumps(PEEK, dumps_compact), delim);
-                    output = 0;
-                    break;
-                case 'd':  // delete
-                    arg1 = (char*) strdup(optarg);
-                    json = POP;
-                    PUSH(delete(json, arg1));
-                    output = 1;
-                    break;
-                case 'i':  // insert
-                    arg1 = (char*) strdup(optarg);
-                    jval = POP;
-                    json = POP;
-                    PUSH(update_native(json, arg1, jval));
-                    output = 1;
-                    break;
-                case 'a':  // across
-                    // something about -a is not mappable?
-                    MAPPUSH();
-                    empty = map_safe_peek()->fin;
-                    if (!empty)
-                        {MAPNEXT();}
-                    output = 0;
-                    break;
-                case 'P':  // not manipulations
-                case 'S': 
-                case 'Q':
-                case 'V':
-                case 'C':
-                case 'I':
-                case 'F':
-                case '0':
-                    break;
-                default:
-                    if (crash)
-                        {exit(2);}
-                    break;
-            }
-            if (empty)
-                {break;}
-        }
-        if (!in_place && output && stackpointer != stack)
-            {printf("%s\n", smart_dumps(PEEK, 0));}
-    } while (! MAPEMPTY);
+    if (run_actions(argc, argv))
+        {exit(0);}
 
     if (in_place && strlen(file_path) > 0)
     {
         fp = fopen(file_path, "w");
-        fprintf(fp, "%s\n", smart_dumps(stack[0], 0));
-        fclose(fp);
+        if (!fp)
+        {
+            fprintf(errout, "unable to write file %s: %s\n", file_path, strerror(errno));
+            exit(1);
+        }
+        write_document(stack[0], fp);
+        if (fclose(fp))
+            {hard_err("error: failed to write output");}
     }
     return 0;
 }